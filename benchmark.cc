@@ -1,75 +1,450 @@
 #include "chunkdata.h"
+#include "chunkmanager.h"
 #include "chunkmap.h"
 #include "flags.h"
+#include "geometry.h"
 #include "octree.h"
-#include "stats.h"
 #include "terragen.h"
 
+#include <boost/functional/hash.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include <iostream>
 #include <sstream>
+#include <string>
+#include <vector>
 
-int main(int argc, char **argv) {
-	parseCommandLine(argc, argv);
+#include <ctime>
+
+namespace {
+
+	double now() {
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return t.tv_sec + 1e-9 * t.tv_nsec;
+	}
+
+	// The hasher that ChunkMap used to use, for comparison.
+	struct FloatXorCoordsHasher {
+		size_t operator()(int3 p) const {
+			static boost::hash<float> hasher;
+			return hasher(p.x) ^ hasher(p.y) ^ hasher(p.z);
+		}
+	};
+
+	/* Simulates the linear probing table of ChunkMap, at its maximum load factor,
+	 * and prints how well the given hasher spreads the indices over it.
+	 */
+	template<typename Hasher>
+	void benchmarkHasher(char const *name, std::vector<int3> const &indices) {
+		Hasher hasher;
+		unsigned capacity = 1;
+		while (capacity < 2 * indices.size()) {
+			capacity *= 2;
+		}
+		unsigned const mask = capacity - 1;
+
+		std::vector<unsigned> bucketSizes(capacity, 0);
+		std::vector<int> slots(capacity, -1);
+		for (unsigned k = 0; k < indices.size(); ++k) {
+			unsigned i = hasher(indices[k]) & mask;
+			++bucketSizes[i];
+			while (slots[i] >= 0) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = k;
+		}
+		unsigned usedBuckets = 0;
+		unsigned maxBucketSize = 0;
+		for (unsigned i = 0; i < capacity; ++i) {
+			usedBuckets += bucketSizes[i] ? 1 : 0;
+			maxBucketSize = std::max(maxBucketSize, bucketSizes[i]);
+		}
+
+		unsigned long totalProbes = 0;
+		unsigned maxProbes = 0;
+		unsigned const repetitions = std::max(1u, 10000000u / (unsigned)indices.size());
+		unsigned long found = 0;
+		double const start = now();
+		for (unsigned r = 0; r < repetitions; ++r) {
+			for (unsigned k = 0; k < indices.size(); ++k) {
+				int3 const index = indices[k];
+				unsigned probes = 1;
+				for (unsigned i = hasher(index) & mask; slots[i] >= 0; i = (i + 1) & mask, ++probes) {
+					if (indices[slots[i]] == index) {
+						++found;
+						break;
+					}
+				}
+				if (r == 0) {
+					totalProbes += probes;
+					maxProbes = std::max(maxProbes, probes);
+				}
+			}
+		}
+		double const elapsed = now() - start;
+		BOOST_ASSERT(found == repetitions * indices.size());
+
+		std::cout
+			<< name << ":\n"
+			<< "  Buckets used: " << usedBuckets << " of " << capacity
+			<< " (ideal " << std::min(capacity, (unsigned)indices.size()) << ")\n"
+			<< "  Largest bucket: " << maxBucketSize << '\n'
+			<< "  Probes per lookup: " << ((float)totalProbes / indices.size()) << " mean, " << maxProbes << " max\n"
+			<< "  Lookup time: " << (1e9 * elapsed / (repetitions * indices.size())) << " ns\n";
+	}
+
+	void benchmarkChunkMapLookups(std::vector<int3> const &indices) {
+		ChunkMap chunkMap;
+		for (unsigned k = 0; k < indices.size(); ++k) {
+			chunkMap[indices[k]];
+		}
+		unsigned const repetitions = std::max(1u, 10000000u / (unsigned)indices.size());
+		unsigned long found = 0;
+		double const start = now();
+		for (unsigned r = 0; r < repetitions; ++r) {
+			for (unsigned k = 0; k < indices.size(); ++k) {
+				found += chunkMap.contains(indices[k]) ? 1 : 0;
+			}
+		}
+		double const elapsed = now() - start;
+		BOOST_ASSERT(found == repetitions * indices.size());
+		std::cout
+			<< "ChunkMap:\n"
+			<< "  Lookup time: " << (1e9 * elapsed / (repetitions * indices.size())) << " ns\n";
+	}
 
-	int const size = flags.benchmarkSize;
-	int3 min = int3(-size / 2);
-	int3 max = min + int3(size);
-	std::cout << "Chunks from " << glm::to_string(min) << " to " << glm::to_string(max) << std::endl;
-
-	ChunkMap chunkMap;
-	PerlinTerrainGenerator generator(32 ,0);
-
-	unsigned generated = 0;
-	unsigned empty = 0;
-	unsigned full = 0;
-	for (int z = min.z; z < max.z; ++z) {
-		for (int y = min.y; y < max.y; ++y) {
-			for (int x = min.x; x < max.x; ++x) {
-				int3 const index = int3(x, y, z);
-
-				RawChunkData chunkData;
-				generator.generateChunk(chunkPositionFromIndex(index), chunkData);
-
-				OctreePtr octree(new Octree());
-				buildOctree(chunkData, *octree);
-
-				ChunkPtr chunk = chunkMap[index];
-				chunk->setOctree(octree);
-
-				++generated;
-				if (octree->isEmpty()) {
-					++empty;
-					std::cout << "E" << std::flush;
-				} else if (octree->getNodes().size() == 1) {
-					++full;
-					std::cout << "F" << std::flush;
-				} else {
-					std::cout << "G" << std::flush;
+	void benchmarkHashing() {
+		// All chunks that ChunkManager considers for a view sphere, including the neighbours needed for tesselation.
+		int const radius = flags.viewDistance / CHUNK_SIZE + 2;
+		std::vector<int3> indices;
+		for (int z = -radius; z <= radius; ++z) {
+			for (int y = -radius; y <= radius; ++y) {
+				for (int x = -radius; x <= radius; ++x) {
+					indices.push_back(int3(x, y, z));
 				}
 			}
 		}
+		std::cout << "Hashing " << indices.size() << " chunk indices from " << glm::to_string(int3(-radius)) << " to " << glm::to_string(int3(radius)) << std::endl;
+		benchmarkHasher<FloatXorCoordsHasher>("Float XOR hasher", indices);
+		benchmarkHasher<CoordsHasher>("CoordsHasher", indices);
+		benchmarkChunkMapLookups(indices);
 	}
-	std::cout
-		<< '\n'
-		<< "Generated " << generated << " total, " << empty << " empty" << ", " << full << " full" << std::endl;
 
-	unsigned tesselated = 0;
-	for (int z = min.z + 1; z < max.z - 1; ++z) {
-		for (int y = min.y + 1; y < max.y - 1; ++y) {
-			for (int x = min.x + 1; x < max.x - 1; ++x) {
-				int3 const index = int3(x, y, z);
-				ChunkPtr chunk = chunkMap[index];
-				ChunkGeometryPtr chunkGeometry(new ChunkGeometry());
-				::tesselate(index, chunkMap, chunkGeometry);
-				chunk->setGeometry(chunkGeometry);
 
-				++tesselated;
-				std::cout << "T" << std::flush;
+	/* Measurements of one stage of chunk production in one repetition.
+	 * Quantities that do not apply to a stage are zero.
+	 */
+	struct StageResult {
+		std::string stage;
+		unsigned repetition;
+		unsigned chunks;
+		double seconds;
+		unsigned long quads;
+		unsigned long nodes;
+		unsigned long bytes;
+		StageResult(std::string stage, unsigned repetition)
+		: stage(stage), repetition(repetition), chunks(0), seconds(0), quads(0), nodes(0), bytes(0) { }
+	};
+
+	/* Generates a cube of chunks, builds their octrees, and tesselates the interior ones,
+	 * timing each stage separately.
+	 * Generating the octrees directly from the noise is timed as a separate stage for comparison.
+	 */
+	void benchmarkChunks(unsigned repetition, std::vector<StageResult> &results) {
+		int const size = flags.benchmarkSize;
+		int3 const min = int3(-size / 2);
+		int3 const max = min + int3(size);
+
+		ChunkMap chunkMap;
+		PerlinTerrainGenerator generator(32, flags.seed);
+
+		StageResult generation("generate", repetition);
+		boost::ptr_vector<PackedChunkData> chunkDatas;
+		std::vector<Block> uniformBlocks;
+		for (int z = min.z; z < max.z; ++z) {
+			for (int y = min.y; y < max.y; ++y) {
+				for (int x = min.x; x < max.x; ++x) {
+					chunkDatas.push_back(new PackedChunkData());
+					double const start = now();
+					uniformBlocks.push_back(generator.generateChunk(chunkPositionFromIndex(int3(x, y, z)), chunkDatas.back()));
+					generation.seconds += now() - start;
+					++generation.chunks;
+					generation.bytes += chunkDatas.back().getSizeInBytes();
+				}
+			}
+		}
+		results.push_back(generation);
+
+		StageResult build("build", repetition);
+		unsigned i = 0;
+		for (int z = min.z; z < max.z; ++z) {
+			for (int y = min.y; y < max.y; ++y) {
+				for (int x = min.x; x < max.x; ++x) {
+					OctreePtr octree(new Octree());
+					double const start = now();
+					if (uniformBlocks[i] != INVALID_BLOCK) {
+						buildUniformOctree(uniformBlocks[i], *octree);
+					} else {
+						buildOctree(chunkDatas[i], *octree);
+					}
+					++i;
+					build.seconds += now() - start;
+					++build.chunks;
+					build.nodes += octree->getNumNodes();
+					build.bytes += octree->getSizeInBytes();
+					chunkMap[int3(x, y, z)]->setOctree(octree);
+				}
 			}
 		}
+		results.push_back(build);
+
+		StageResult topDownBuild("build_top_down", repetition);
+		for (unsigned i = 0; i < chunkDatas.size(); ++i) {
+			Octree octree;
+			double const start = now();
+			if (uniformBlocks[i] != INVALID_BLOCK) {
+				buildUniformOctree(uniformBlocks[i], octree);
+			} else {
+				buildOctreeTopDown(chunkDatas[i], octree);
+			}
+			topDownBuild.seconds += now() - start;
+			++topDownBuild.chunks;
+			topDownBuild.nodes += octree.getNumNodes();
+			topDownBuild.bytes += octree.getSizeInBytes();
+		}
+		results.push_back(topDownBuild);
+
+		StageResult directGeneration("generate_octree", repetition);
+		for (int z = min.z; z < max.z; ++z) {
+			for (int y = min.y; y < max.y; ++y) {
+				for (int x = min.x; x < max.x; ++x) {
+					Octree octree;
+					double const start = now();
+					generator.generateOctree(chunkPositionFromIndex(int3(x, y, z)), octree);
+					directGeneration.seconds += now() - start;
+					++directGeneration.chunks;
+					directGeneration.nodes += octree.getNumNodes();
+					directGeneration.bytes += octree.getSizeInBytes();
+				}
+			}
+		}
+		results.push_back(directGeneration);
+
+		StageResult tesselation("tesselate", repetition);
+		for (int z = min.z + 1; z < max.z - 1; ++z) {
+			for (int y = min.y + 1; y < max.y - 1; ++y) {
+				for (int x = min.x + 1; x < max.x - 1; ++x) {
+					int3 const index = int3(x, y, z);
+					ChunkGeometryPtr chunkGeometry(new ChunkGeometry());
+					double const start = now();
+					::tesselate(index, chunkMap, chunkGeometry);
+					tesselation.seconds += now() - start;
+					++tesselation.chunks;
+					tesselation.quads += chunkGeometry->getNumQuads();
+					tesselation.bytes += chunkGeometry->getSizeInBytes();
+					chunkMap[index]->setGeometry(chunkGeometry);
+				}
+			}
+		}
+		results.push_back(tesselation);
 	}
-	std::cout
-		<< '\n'
-		<< "Tesselated " << tesselated << std::endl;
 
-	stats.print();
+	void writeCsv(std::vector<StageResult> const &results, std::ostream &out) {
+		out << "stage,repetition,chunks,seconds,chunks_per_second,blocks_per_second,quads_per_second,nodes_per_octree,bytes_per_chunk\n";
+		for (unsigned i = 0; i < results.size(); ++i) {
+			StageResult const &r = results[i];
+			out
+				<< r.stage << ','
+				<< r.repetition << ','
+				<< r.chunks << ','
+				<< r.seconds << ','
+				<< (r.chunks / r.seconds) << ','
+				<< ((double)r.chunks * BLOCKS_PER_CHUNK / r.seconds) << ','
+				<< (r.quads / r.seconds) << ','
+				<< ((double)r.nodes / r.chunks) << ','
+				<< ((double)r.bytes / r.chunks) << '\n';
+		}
+	}
+
+	void writeJson(std::vector<StageResult> const &results, std::ostream &out) {
+		out
+			<< "{\n"
+			<< "  \"seed\": " << flags.seed << ",\n"
+			<< "  \"size\": " << flags.benchmarkSize << ",\n"
+			<< "  \"warmup\": " << flags.benchmarkWarmup << ",\n"
+			<< "  \"repetitions\": " << flags.benchmarkRepetitions << ",\n"
+			<< "  \"results\": [\n";
+		for (unsigned i = 0; i < results.size(); ++i) {
+			StageResult const &r = results[i];
+			out
+				<< "    {"
+				<< "\"stage\": \"" << r.stage << "\", "
+				<< "\"repetition\": " << r.repetition << ", "
+				<< "\"chunks\": " << r.chunks << ", "
+				<< "\"seconds\": " << r.seconds << ", "
+				<< "\"chunks_per_second\": " << (r.chunks / r.seconds) << ", "
+				<< "\"blocks_per_second\": " << ((double)r.chunks * BLOCKS_PER_CHUNK / r.seconds) << ", "
+				<< "\"quads_per_second\": " << (r.quads / r.seconds) << ", "
+				<< "\"nodes_per_octree\": " << ((double)r.nodes / r.chunks) << ", "
+				<< "\"bytes_per_chunk\": " << ((double)r.bytes / r.chunks)
+				<< (i + 1 < results.size() ? "},\n" : "}\n");
+		}
+		out
+			<< "  ]\n"
+			<< "}\n";
+	}
+
+
+	/* Measurements of pre-generating the region with a given number of threads.
+	 */
+	struct PregenResult {
+		unsigned threads;
+		unsigned chunks;
+		unsigned chunksTesselated;
+		double seconds;
+		PregenResult(unsigned threads) : threads(threads), chunks(0), chunksTesselated(0), seconds(0) { }
+	};
+
+	/* Runs the same pipeline as the game, until every chunk in the view sphere around the start point
+	 * has been tesselated. Neighbours are generated as the ChunkManager sees fit.
+	 */
+	PregenResult pregen(unsigned numThreads) {
+		ChunkMap chunkMap;
+		ChunkManager chunkManager(chunkMap, new PerlinTerrainGenerator(32, flags.seed), numThreads);
+		ViewSpherePtr viewSphere(new ViewSphere(vec3(flags.startX, flags.startY, flags.startZ), flags.viewDistance));
+		chunkManager.addViewSphere(viewSphere);
+
+		PregenResult result(numThreads);
+		double const start = now();
+		while (true) {
+			chunkManager.sow();
+			if (chunkManager.isComplete()) {
+				break;
+			}
+			// Returns right away if no job is in flight, so sow() gets another go.
+			chunkManager.waitAndReap();
+		}
+		result.seconds = now() - start;
+
+		std::vector<ChunkPtr> const &chunks = chunkManager.getLoadedChunks();
+		result.chunks = chunks.size();
+		for (unsigned i = 0; i < chunks.size(); ++i) {
+			if (chunks[i]->getState() == Chunk::TESSELATED) {
+				++result.chunksTesselated;
+			}
+		}
+		return result;
+	}
+
+	/* Pre-generates the region with 1, 2, 4, ... threads, up to the maximum,
+	 * and reports how the fastest of the repetitions compares to the single-threaded one.
+	 */
+	void benchmarkPregen() {
+		unsigned const maxThreads = flags.benchmarkMaxThreads ? flags.benchmarkMaxThreads : ThreadPool::defaultNumThreads();
+		std::vector<unsigned> threadCounts;
+		for (unsigned n = 1; n < maxThreads; n *= 2) {
+			threadCounts.push_back(n);
+		}
+		threadCounts.push_back(maxThreads);
+
+		for (unsigned i = 0; i < flags.benchmarkWarmup; ++i) {
+			pregen(maxThreads);
+		}
+		std::vector<PregenResult> results;
+		for (unsigned i = 0; i < threadCounts.size(); ++i) {
+			PregenResult best(threadCounts[i]);
+			for (unsigned j = 0; j < std::max(1u, flags.benchmarkRepetitions); ++j) {
+				PregenResult const result = pregen(threadCounts[i]);
+				if (j == 0 || result.seconds < best.seconds) {
+					best = result;
+				}
+			}
+			results.push_back(best);
+		}
+
+		bool const csv = flags.benchmarkFormat == "csv";
+		if (csv) {
+			std::cout << "threads,chunks,chunks_tesselated,seconds,chunks_per_second,speedup,efficiency\n";
+		} else {
+			std::cout
+				<< "{\n"
+				<< "  \"seed\": " << flags.seed << ",\n"
+				<< "  \"view_distance\": " << flags.viewDistance << ",\n"
+				<< "  \"warmup\": " << flags.benchmarkWarmup << ",\n"
+				<< "  \"repetitions\": " << flags.benchmarkRepetitions << ",\n"
+				<< "  \"results\": [\n";
+		}
+		for (unsigned i = 0; i < results.size(); ++i) {
+			PregenResult const &r = results[i];
+			double const speedup = results[0].seconds / r.seconds;
+			double const efficiency = speedup / r.threads;
+			if (csv) {
+				std::cout
+					<< r.threads << ','
+					<< r.chunks << ','
+					<< r.chunksTesselated << ','
+					<< r.seconds << ','
+					<< (r.chunks / r.seconds) << ','
+					<< speedup << ','
+					<< efficiency << '\n';
+			} else {
+				std::cout
+					<< "    {"
+					<< "\"threads\": " << r.threads << ", "
+					<< "\"chunks\": " << r.chunks << ", "
+					<< "\"chunks_tesselated\": " << r.chunksTesselated << ", "
+					<< "\"seconds\": " << r.seconds << ", "
+					<< "\"chunks_per_second\": " << (r.chunks / r.seconds) << ", "
+					<< "\"speedup\": " << speedup << ", "
+					<< "\"efficiency\": " << efficiency
+					<< (i + 1 < results.size() ? "},\n" : "}\n");
+			}
+		}
+		if (!csv) {
+			std::cout
+				<< "  ]\n"
+				<< "}\n";
+		}
+	}
+
+}
+
+int main(int argc, char **argv) {
+	parseCommandLine(argc, argv);
+
+	if (flags.benchmarkHasher) {
+		benchmarkHashing();
+		return 0;
+	}
+
+	if (flags.benchmarkFormat != "json" && flags.benchmarkFormat != "csv") {
+		std::cerr << "Unknown benchmark format " << flags.benchmarkFormat << '\n';
+		return 1;
+	}
+
+	if (flags.benchmarkPregen) {
+		benchmarkPregen();
+		return 0;
+	}
+
+	if (flags.benchmarkSize < 3) {
+		std::cerr << "Benchmark size must be at least 3, or there is nothing to tesselate\n";
+		return 1;
+	}
+
+	std::vector<StageResult> results;
+	for (unsigned i = 0; i < flags.benchmarkWarmup; ++i) {
+		std::vector<StageResult> discarded;
+		benchmarkChunks(i, discarded);
+	}
+	for (unsigned i = 0; i < flags.benchmarkRepetitions; ++i) {
+		benchmarkChunks(i, results);
+	}
+
+	if (flags.benchmarkFormat == "csv") {
+		writeCsv(results, std::cout);
+	} else {
+		writeJson(results, std::cout);
+	}
 }
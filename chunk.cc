@@ -54,6 +54,26 @@ void Chunk::setGeometry(ChunkGeometryPtr geometry) {
 	buffers.reset();
 }
 
+void Chunk::evict() {
+	BOOST_ASSERT(!upgrading);
+	octree.reset();
+	geometry.reset();
+	buffers.reset();
+	state = NEW;
+}
+
+unsigned Chunk::getSizeInBytes() const {
+	unsigned size = sizeof(Chunk);
+	if (octree) {
+		size += octree->getSizeInBytes();
+	}
+	if (geometry) {
+		// Counted twice: once in main memory, once in the GL buffers.
+		size += 2 * geometry->getSizeInBytes();
+	}
+	return size;
+}
+
 void Chunk::render() {
 	if (!geometry || geometry->isEmpty()) {
 		return;
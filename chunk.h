@@ -7,6 +7,7 @@
 #include "octree.h"
 #include "gl.h"
 
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -37,7 +38,8 @@ void render(ChunkBuffers const &buffers);
 
 class Chunk
 :
-	boost::noncopyable
+	boost::noncopyable,
+	public boost::enable_shared_from_this<Chunk>
 {
 
 	public:
@@ -74,11 +76,14 @@ class Chunk
 		void endUpgrade();
 		void setOctree(OctreePtr octree);
 		void setGeometry(ChunkGeometryPtr geometry);
+		void evict();
 
 		OctreePtr getOctree() { return octree; }
 		OctreeConstPtr getOctree() const { return octree; }
 		ChunkGeometryConstPtr getGeometry() const { return geometry; }
 
+		unsigned getSizeInBytes() const;
+
 		void render();
 	
 };
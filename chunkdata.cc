@@ -2,6 +2,9 @@
 
 #include "stats.h"
 
+#include <boost/assert.hpp>
+
+#include <algorithm>
 #include <limits>
 
 RawChunkData::RawChunkData() {
@@ -19,6 +22,20 @@ Block const &RawChunkData::operator[](int3 pos) const {
 	return blocks[CHUNK_SIZE * CHUNK_SIZE * pos.z + CHUNK_SIZE * pos.y + pos.x];
 }
 
+void RawChunkData::fill(unsigned index, unsigned count, Block block) {
+	std::fill(&blocks[index], &blocks[index + count], block);
+}
+
+bool RawChunkData::isUniformRun(unsigned index, unsigned count, unsigned referenceIndex) const {
+	Block const reference = blocks[referenceIndex];
+	for (Block const *p = &blocks[index], *end = p + count; p != end; ++p) {
+		if (*p != reference) {
+			return false;
+		}
+	}
+	return true;
+}
+
 RawChunkData::iterator RawChunkData::begin() {
 	return &blocks[0];
 }
@@ -42,3 +59,122 @@ Block const *RawChunkData::raw() const {
 Block *RawChunkData::raw() {
 	return &blocks[0];
 }
+
+unsigned const PackedChunkData::MAX_BITS_SHIFT = 4;
+
+PackedChunkData::PackedChunkData() {
+	clear();
+}
+
+void PackedChunkData::clear() {
+	palette.assign(1, AIR_BLOCK);
+	bitsShift = 0;
+	blocksShift = 5;
+	codeMask = 1;
+	words.assign(BLOCKS_PER_CHUNK >> blocksShift, 0);
+}
+
+unsigned PackedChunkData::getSizeInBytes() const {
+	return words.size() * sizeof(uint32_t) + palette.size() * sizeof(Block);
+}
+
+unsigned PackedChunkData::encode(Block block) {
+	for (unsigned code = 0; code < palette.size(); ++code) {
+		if (palette[code] == block) {
+			return code;
+		}
+	}
+	if (palette.size() > codeMask) {
+		widen();
+	}
+	palette.push_back(block);
+	return palette.size() - 1;
+}
+
+void PackedChunkData::fillCodes(unsigned index, unsigned count, unsigned code) {
+	unsigned const end = index + count;
+	unsigned const blocksPerWord = 1 << blocksShift;
+	for (; index < end && (index & (blocksPerWord - 1)); ++index) {
+		setCode(index, code);
+	}
+	if (index + blocksPerWord <= end) {
+		uint32_t const pattern = replicate(code);
+		for (; index + blocksPerWord <= end; index += blocksPerWord) {
+			words[index >> blocksShift] = pattern;
+		}
+	}
+	for (; index < end; ++index) {
+		setCode(index, code);
+	}
+}
+
+Block PackedChunkData::operator[](int3 pos) const {
+	return get(CHUNK_SIZE * CHUNK_SIZE * pos.z + CHUNK_SIZE * pos.y + pos.x);
+}
+
+void PackedChunkData::set(int3 pos, Block block) {
+	set(CHUNK_SIZE * CHUNK_SIZE * pos.z + CHUNK_SIZE * pos.y + pos.x, block);
+}
+
+bool PackedChunkData::isUniformRun(unsigned index, unsigned count, unsigned referenceIndex) const {
+	unsigned const code = getCode(referenceIndex);
+	unsigned const end = index + count;
+	unsigned const blocksPerWord = 1 << blocksShift;
+	for (; index < end && (index & (blocksPerWord - 1)); ++index) {
+		if (getCode(index) != code) {
+			return false;
+		}
+	}
+	if (index + blocksPerWord <= end) {
+		// Compare whole words at once.
+		uint32_t const pattern = replicate(code);
+		for (; index + blocksPerWord <= end; index += blocksPerWord) {
+			if (words[index >> blocksShift] != pattern) {
+				return false;
+			}
+		}
+	}
+	for (; index < end; ++index) {
+		if (getCode(index) != code) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void PackedChunkData::unpack(RawChunkData &rawChunkData) const {
+	Block *p = rawChunkData.raw();
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		*p = get(i);
+		++p;
+	}
+}
+
+uint32_t PackedChunkData::replicate(unsigned code) const {
+	uint32_t pattern = code;
+	for (unsigned bits = getBitsPerBlock(); bits < 32; bits *= 2) {
+		pattern |= pattern << bits;
+	}
+	return pattern;
+}
+
+void PackedChunkData::widen() {
+	BOOST_ASSERT(bitsShift < MAX_BITS_SHIFT);
+	std::vector<uint32_t> oldWords;
+	oldWords.swap(words);
+	unsigned const oldBitsShift = bitsShift;
+	unsigned const oldBlocksShift = blocksShift;
+	uint32_t const oldCodeMask = codeMask;
+
+	++bitsShift;
+	--blocksShift;
+	codeMask = (1 << getBitsPerBlock()) - 1;
+	words.assign(BLOCKS_PER_CHUNK >> blocksShift, 0);
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		unsigned const oldShift = (i & ((1 << oldBlocksShift) - 1)) << oldBitsShift;
+		unsigned const code = (oldWords[i >> oldBlocksShift] >> oldShift) & oldCodeMask;
+		if (code) {
+			setCode(i, code);
+		}
+	}
+}
@@ -9,6 +9,8 @@
 #include <boost/scoped_array.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <stdint.h>
+
 #include <vector>
 
 class RawChunkData
@@ -28,6 +30,10 @@ class RawChunkData
 		Block &operator[](int3 pos);
 		Block const &operator[](int3 pos) const;
 
+		Block get(unsigned index) const { return blocks[index]; }
+		void fill(unsigned index, unsigned count, Block block);
+		bool isUniformRun(unsigned index, unsigned count, unsigned referenceIndex) const;
+
 		iterator begin();
 		iterator end();
 		const_iterator begin() const;
@@ -40,4 +46,69 @@ class RawChunkData
 
 typedef boost::shared_ptr<RawChunkData> RawChunkDataPtr;
 
+/* Stores the blocks of a chunk as indices (codes) into a per-chunk palette of distinct blocks,
+ * packed into 32-bit words at 1, 2, 4 or 8 bits per block, the smallest that fits the palette.
+ * Blocks never straddle words. Beyond 256 distinct blocks, it falls back to 16 bits per block.
+ *
+ * Blocks are indexed in the same z, y, x order as RawChunkData.
+ * A cleared chunk is all AIR_BLOCK, which always has code 0.
+ */
+class PackedChunkData
+:
+	boost::noncopyable
+{
+
+	static unsigned const MAX_BITS_SHIFT;
+
+	std::vector<Block> palette;
+	unsigned bitsShift;
+	unsigned blocksShift;
+	uint32_t codeMask;
+	std::vector<uint32_t> words;
+
+	public:
+
+		PackedChunkData();
+
+		void clear();
+
+		unsigned getBitsPerBlock() const { return 1 << bitsShift; }
+		unsigned getBlocksPerWord() const { return 1 << blocksShift; }
+		std::vector<Block> const &getPalette() const { return palette; }
+		unsigned getSizeInBytes() const;
+
+		// Returns the code for the block, adding it to the palette and widening the storage if needed.
+		// Codes handed out earlier stay valid.
+		unsigned encode(Block block);
+
+		unsigned getCode(unsigned index) const {
+			unsigned const shift = (index & ((1 << blocksShift) - 1)) << bitsShift;
+			return (words[index >> blocksShift] >> shift) & codeMask;
+		}
+		void setCode(unsigned index, unsigned code) {
+			unsigned const shift = (index & ((1 << blocksShift) - 1)) << bitsShift;
+			uint32_t &word = words[index >> blocksShift];
+			word = (word & ~(codeMask << shift)) | (code << shift);
+		}
+		void fillCodes(unsigned index, unsigned count, unsigned code);
+
+		// The word holding the code of the given block in its lowest bits.
+		uint32_t getWord(unsigned index) const { return words[index >> blocksShift]; }
+
+		Block get(unsigned index) const { return palette[getCode(index)]; }
+		Block operator[](int3 pos) const;
+		void set(unsigned index, Block block) { setCode(index, encode(block)); }
+		void set(int3 pos, Block block);
+		void fill(unsigned index, unsigned count, Block block) { fillCodes(index, count, encode(block)); }
+		bool isUniformRun(unsigned index, unsigned count, unsigned referenceIndex) const;
+
+		void unpack(RawChunkData &rawChunkData) const;
+
+	private:
+
+		uint32_t replicate(unsigned code) const;
+		void widen();
+
+};
+
 #endif
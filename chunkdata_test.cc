@@ -0,0 +1,85 @@
+#include "chunkdata.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib>
+
+BOOST_AUTO_TEST_SUITE(ChunkDataTest)
+
+BOOST_AUTO_TEST_CASE(TestPackedStartsEmpty) {
+	PackedChunkData data;
+	BOOST_REQUIRE_EQUAL(1u, data.getBitsPerBlock());
+	BOOST_REQUIRE_EQUAL(1u, data.getPalette().size());
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; i += 1234) {
+		BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data.get(i));
+	}
+	BOOST_REQUIRE_LT(data.getSizeInBytes(), BLOCKS_PER_CHUNK * sizeof(Block) / 16);
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedSetGet) {
+	PackedChunkData data;
+	data.set(int3(1, 2, 3), STONE_BLOCK);
+	BOOST_REQUIRE_EQUAL(1u, data.getBitsPerBlock());
+	BOOST_REQUIRE_EQUAL((Block)STONE_BLOCK, data[int3(1, 2, 3)]);
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data[int3(0, 2, 3)]);
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data[int3(2, 2, 3)]);
+	data.set(int3(1, 2, 3), AIR_BLOCK);
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data[int3(1, 2, 3)]);
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedWidens) {
+	PackedChunkData data;
+	srand(0);
+	std::vector<Block> expected(BLOCKS_PER_CHUNK, AIR_BLOCK);
+	// The palette also holds AIR_BLOCK.
+	unsigned const numBlocks[] = { 1, 2, 3, 4, 15, 16, 255, 256 };
+	unsigned const expectedBits[] = { 1, 2, 2, 4, 4, 8, 8, 16 };
+	for (unsigned step = 0; step < 8; ++step) {
+		for (unsigned i = 0; i < 1000; ++i) {
+			unsigned const index = rand() % BLOCKS_PER_CHUNK;
+			Block const block = 100 + rand() % numBlocks[step];
+			data.set(index, block);
+			expected[index] = block;
+		}
+		// Make sure the palette is as big as we want it.
+		for (Block block = 100; block < 100 + numBlocks[step]; ++block) {
+			data.set(step, block);
+			expected[step] = block;
+		}
+		BOOST_REQUIRE_EQUAL(expectedBits[step], data.getBitsPerBlock());
+		for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+			BOOST_REQUIRE_EQUAL(expected[i], data.get(i));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedFillAndUniformRuns) {
+	PackedChunkData data;
+	data.set(0, STONE_BLOCK);
+	data.fill(5, 100, STONE_BLOCK);
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data.get(4));
+	BOOST_REQUIRE_EQUAL((Block)STONE_BLOCK, data.get(5));
+	BOOST_REQUIRE_EQUAL((Block)STONE_BLOCK, data.get(104));
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, data.get(105));
+	BOOST_REQUIRE(data.isUniformRun(5, 100, 0));
+	BOOST_REQUIRE(!data.isUniformRun(4, 100, 0));
+	BOOST_REQUIRE(!data.isUniformRun(6, 100, 0));
+	BOOST_REQUIRE(data.isUniformRun(105, 1000, 105));
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedUnpack) {
+	PackedChunkData data;
+	srand(0);
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		if (rand() % 3 == 0) {
+			data.set(i, 1 + rand() % 3);
+		}
+	}
+	RawChunkData raw;
+	data.unpack(raw);
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		BOOST_REQUIRE_EQUAL(data.get(i), raw.get(i));
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
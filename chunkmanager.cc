@@ -1,62 +1,317 @@
 #include "chunkmanager.h"
 
 #include "chunkmap.h"
+#include "chunkstore.h"
+#include "flags.h"
 #include "stats.h"
 #include "terragen.h"
+#include "trace.h"
 
-ChunkManager::ChunkManager(ChunkMap &chunkMap, TerrainGenerator *terrainGenerator)
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+ChunkManager::ChunkManager(ChunkMap &chunkMap, TerrainGenerator *terrainGenerator, unsigned numThreads)
 :
 	chunkMap(chunkMap),
 	terrainGenerator(terrainGenerator),
+	chunkStore(flags.chunkStore.empty() ? 0 : new ChunkStore(flags.chunkStore, flags.seed)),
+	maxNumChunks(computeMaxNumChunks()),
+	maxChunkMemory((unsigned long)flags.maxChunkMemory << 20),
+	numJobsInFlight(0),
+	numEvictedSinceCompaction(0),
+	currentEpoch(new Epoch()),
 	finalizerQueue(0), // infinite, otherwise threads may block at program exit
-	threadPool(ThreadPool::defaultNumThreads())
+	// Jobs that are no longer wanted get cancelled, so we can afford to queue a few per thread.
+	threadPool(4 * numThreads, numThreads)
+{
+}
+
+ChunkManager::~ChunkManager() {
+}
+
+ChunkManager::Schedule::Schedule(WeakConstViewSpherePtr viewSphere)
+:
+	viewSphere(viewSphere),
+	radius(-1.0f),
+	numDone(0),
+	next(0)
 {
 }
 
 void ChunkManager::addViewSphere(WeakConstViewSpherePtr viewSphere) {
-	viewSpheres.push_back(viewSphere);
+	schedules.push_back(Schedule(viewSphere));
 }
 
 void ChunkManager::sow() {
+	updateSchedules();
+	// The view spheres may have moved, so the waiting jobs may have become more or less urgent, or unwanted.
+	threadPool.reprioritize();
+
 	unsigned jobsToAdd = threadPool.getMaxQueueSize() - threadPool.getQueueSize();
 	if (jobsToAdd == 0) {
 		return;
 	}
 
+	// Neighbours that need to be upgraded before the chunk that wanted them.
 	PriorityQueue queue;
-	for (unsigned i = 0; i < viewSpheres.size(); ++i) {
-		if (ConstViewSpherePtr sphere = viewSpheres[i].lock()) {
-			// TODO write chunksInSphere iterator
-			int3 min = chunkIndexFromPoint(sphere->center - sphere->radius);
-			int3 max = chunkIndexFromPoint(sphere->center + sphere->radius);
-			for (int z = min.z; z <= max.z; ++z) {
-				for (int y = min.y; y <= max.y; ++y) {
-					for (int x = min.x; x <= max.x; ++x) {
-						// TODO filter on the sphere
-						int3 index(x, y, z);
-						float priority = length(chunkCenter(index) - sphere->center); // lower is better
-						queue.push(makePrioritized(priority, index));
+	PrioritizedIndex prioIndex(0, int3());
+	while (jobsToAdd && nextScheduled(&prioIndex, queue)) {
+		if (tryUpgradeChunk(prioIndex, queue)) {
+			--jobsToAdd;
+		}
+	}
+
+	// Chunks whose tesselation was skipped are done without a job, so nothing else would
+	// let isComplete() know; if they were the last ones, the caller would wait for a finalizer forever.
+	for (unsigned i = 0; i < schedules.size(); ++i) {
+		skipDone(schedules[i]);
+	}
+}
+
+void ChunkManager::skipDone(Schedule &schedule) {
+	while (schedule.numDone < schedule.offsets.size() &&
+			chunkMap.getChunkState(schedule.centerIndex + schedule.offsets[schedule.numDone].item) == Chunk::TESSELATED) {
+		++schedule.numDone;
+	}
+	schedule.next = std::max(schedule.next, schedule.numDone);
+}
+
+void ChunkManager::updateSchedules() {
+	viewSpheres.clear();
+	for (unsigned i = 0; i < schedules.size();) {
+		Schedule &schedule = schedules[i];
+		ConstViewSpherePtr sphere = schedule.viewSphere.lock();
+		if (!sphere) {
+			schedules.erase(schedules.begin() + i);
+			continue;
+		}
+		if (schedule.radius != sphere->radius) {
+			schedule.radius = sphere->radius;
+			schedule.offsets.clear();
+			int const r = (int)ceilf(sphere->radius / CHUNK_SIZE) + 1;
+			for (int z = -r; z <= r; ++z) {
+				for (int y = -r; y <= r; ++y) {
+					for (int x = -r; x <= r; ++x) {
+						int3 const offset(x, y, z);
+						if (distanceBetweenChunks(offset) <= sphere->radius) {
+							// Lower is better.
+							float const priority = CHUNK_SIZE * length(vec3(offset));
+							schedule.offsets.push_back(makePrioritized(priority, offset));
+						}
 					}
 				}
 			}
-		} else {
-			viewSpheres.erase(viewSpheres.begin() + i);
+			// Prioritized sorts in reverse, so that priority queues return the lowest number first.
+			std::sort(schedule.offsets.rbegin(), schedule.offsets.rend());
+			schedule.numDone = 0;
 		}
+		int3 const centerIndex = chunkIndexFromPoint(sphere->center);
+		if (schedule.centerIndex != centerIndex) {
+			schedule.centerIndex = centerIndex;
+			schedule.numDone = 0;
+		}
+		schedule.next = schedule.numDone;
+		viewSpheres.push_back(*sphere);
+		++i;
 	}
+}
 
-	while (jobsToAdd && !queue.empty()) {
-		PrioritizedIndex prioIndex = queue.top();
-		queue.pop();
-		if (tryUpgradeChunk(prioIndex, queue)) {
-			--jobsToAdd;
+bool ChunkManager::nextScheduled(PrioritizedIndex *prioIndex, PriorityQueue &queue) {
+	Schedule *best = 0;
+	for (unsigned i = 0; i < schedules.size(); ++i) {
+		Schedule &schedule = schedules[i];
+		// Skip over the prefix of chunks that are done, so we need not look at them again.
+		if (schedule.next == schedule.numDone) {
+			skipDone(schedule);
+		}
+		if (schedule.next < schedule.offsets.size() &&
+				(!best || schedule.offsets[schedule.next].priority < best->offsets[best->next].priority)) {
+			best = &schedule;
 		}
 	}
+	if (!queue.empty() && (!best || queue.top().priority <= best->offsets[best->next].priority)) {
+		*prioIndex = queue.top();
+		queue.pop();
+		return true;
+	}
+	if (best) {
+		PrioritizedIndex const &offset = best->offsets[best->next];
+		*prioIndex = makePrioritized(offset.priority, best->centerIndex + offset.item);
+		++best->next;
+		return true;
+	}
+	return false;
 }
 
 void ChunkManager::reap() {
 	finalizerQueue.runAll();
 }
 
+void ChunkManager::waitAndReap() {
+	// Without jobs in flight, no finalizer will come, so waiting would block forever.
+	if (numJobsInFlight == 0) {
+		reap();
+		return;
+	}
+	finalizerQueue.runOne();
+	finalizerQueue.runAll();
+}
+
+bool ChunkManager::isComplete() const {
+	// As of the last call to sow(), which is what updates numDone.
+	for (unsigned i = 0; i < schedules.size(); ++i) {
+		if (schedules[i].numDone < schedules[i].offsets.size()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void ChunkManager::evict() {
+	unsigned numChunks = loadedChunks.size();
+	unsigned long chunkMemory = 0;
+	if (maxChunkMemory) {
+		for (unsigned i = 0; i < loadedChunks.size(); ++i) {
+			chunkMemory += loadedChunks[i]->getSizeInBytes();
+		}
+		// The shells of chunks that are not loaded, and the map's tables, count too.
+		chunkMemory += (chunkMap.size() - loadedChunks.size()) * sizeof(Chunk) + chunkMap.getSizeInBytes();
+	}
+	if (!isOverBudget(numChunks, chunkMemory)) {
+		return;
+	}
+
+	// Farthest chunks first. Chunks that a view sphere might still need, either directly
+	// or as a neighbour for tesselation, are never evicted, and neither are chunks
+	// that a job might currently be reading: those of upgrading chunks and their neighbours.
+	std::priority_queue<Prioritized<unsigned> > queue;
+	for (unsigned i = 0; i < loadedChunks.size(); ++i) {
+		int3 const index = loadedChunks[i]->getIndex();
+		float const distance = distanceOutsideSchedules(index);
+		if (isBeyondReach(distance) && !isNeighbourhoodUpgrading(index)) {
+			queue.push(makePrioritized(-distance, i));
+		}
+	}
+
+	while (!queue.empty() && isOverBudget(numChunks, chunkMemory)) {
+		Chunk &chunk = *loadedChunks[queue.top().item];
+		queue.pop();
+		--numChunks;
+		chunkMemory -= std::min(chunkMemory, (unsigned long)chunk.getSizeInBytes());
+		chunk.evict();
+		++numEvictedSinceCompaction;
+		stats.chunksEvicted.increment();
+	}
+
+	unsigned j = 0;
+	for (unsigned i = 0; i < loadedChunks.size(); ++i) {
+		if (loadedChunks[i]->getState() != Chunk::NEW) {
+			loadedChunks[j++] = loadedChunks[i];
+		}
+	}
+	loadedChunks.resize(j);
+
+	// Once the shells outnumber the loaded chunks, the map is mostly garbage.
+	if (numEvictedSinceCompaction > loadedChunks.size()) {
+		compact();
+	}
+}
+
+void ChunkManager::compact() {
+	unsigned const size = chunkMap.size();
+	currentEpoch->garbage = chunkMap.compact();
+	stats.chunksRemoved.increment(size - chunkMap.size());
+	numEvictedSinceCompaction = 0;
+
+	// If no job holds on to the old epoch, this frees the garbage right away.
+	EpochPtr const next(new Epoch());
+	currentEpoch->next = next;
+	currentEpoch = next;
+}
+
+unsigned ChunkManager::computeMaxNumChunks() {
+	if (flags.maxNumChunks != 0) {
+		return flags.maxNumChunks;
+	}
+	// Enough for everything that the view sphere might want, plus the neighbours needed for tesselation;
+	// this is exactly the set of chunks that evict() will not touch.
+	float const maxDistance = flags.viewDistance + 2 * CHUNK_RADIUS;
+	int const r = (int)ceilf(maxDistance / CHUNK_SIZE) + 1;
+	unsigned numChunks = 0;
+	for (int z = -r; z <= r; ++z) {
+		for (int y = -r; y <= r; ++y) {
+			for (int x = -r; x <= r; ++x) {
+				if (distanceBetweenChunks(int3(x, y, z)) <= maxDistance) {
+					++numChunks;
+				}
+			}
+		}
+	}
+	return numChunks;
+}
+
+float ChunkManager::distanceBetweenChunks(int3 offset) {
+	// The shortest distance between any two points in chunks whose indices are this far apart.
+	vec3 const gap(
+			std::max(std::abs(offset.x) - 1, 0),
+			std::max(std::abs(offset.y) - 1, 0),
+			std::max(std::abs(offset.z) - 1, 0));
+	return CHUNK_SIZE * length(gap);
+}
+
+bool ChunkManager::isBeyondReach(float distanceOutside) {
+	// Chunks this far out are not wanted by the view sphere, nor needed to tesselate a chunk that is.
+	return distanceOutside > 2 * CHUNK_RADIUS;
+}
+
+float ChunkManager::distanceOutsideSchedules(int3 index) const {
+	float distance = std::numeric_limits<float>::infinity();
+	for (unsigned i = 0; i < schedules.size(); ++i) {
+		Schedule const &schedule = schedules[i];
+		distance = std::min(distance, distanceBetweenChunks(index - schedule.centerIndex) - schedule.radius);
+	}
+	return distance;
+}
+
+bool ChunkManager::isNeighbourhoodUpgrading(int3 index) const {
+	for (int z = -1; z <= 1; ++z) {
+		for (int y = -1; y <= 1; ++y) {
+			for (int x = -1; x <= 1; ++x) {
+				if (chunkMap.isChunkUpgrading(index + int3(x, y, z))) {
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+bool ChunkManager::isOverBudget(unsigned numChunks, unsigned long chunkMemory) const {
+	return
+		(maxNumChunks && numChunks > maxNumChunks) ||
+		(maxChunkMemory && chunkMemory > maxChunkMemory);
+}
+
+bool ChunkManager::isBuried(int3 index) const {
+	// Faces only appear between solid blocks and air, so a solid chunk
+	// surrounded by solid chunks on all six sides has none.
+	int3 const offsets[] = {
+		int3(0, 0, 0),
+		int3(-1, 0, 0), int3(1, 0, 0),
+		int3(0, -1, 0), int3(0, 1, 0),
+		int3(0, 0, -1), int3(0, 0, 1)
+	};
+	for (unsigned i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+		// An octree of a single node is a chunk of a single block, and air would have no nodes at all.
+		OctreeConstPtr octree = chunkMap.getOctreeOrNull(index + offsets[i]);
+		if (!octree || octree->getNumNodes() != 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
 bool ChunkManager::tryUpgradeChunk(PrioritizedIndex prioIndex, PriorityQueue &queue) {
 	int3 const index = prioIndex.item;
 	if (chunkMap.isChunkUpgrading(index)) {
@@ -99,10 +354,17 @@ bool ChunkManager::tryUpgradeChunk(PrioritizedIndex prioIndex, PriorityQueue &qu
 			}
 		}
 	}
-	if (upgradeSelf) {
-		enqueueUpgrade(chunkMap[index]);
+	if (!upgradeSelf) {
+		return false;
+	}
+	ChunkPtr chunk = chunkMap[index];
+	if (nextState == Chunk::TESSELATED && isBuried(index)) {
+		// Done right away, so no job slot was used.
+		skipTesselation(chunk);
+		return false;
 	}
-	return upgradeSelf;
+	enqueueUpgrade(chunk);
+	return true;
 }
 
 void ChunkManager::enqueueUpgrade(ChunkPtr chunk) {
@@ -117,11 +379,15 @@ void ChunkManager::enqueueGeneration(ChunkPtr chunk) {
 	BOOST_ASSERT(chunk->getState() == Chunk::NEW);
 	BOOST_ASSERT(!chunk->isUpgrading());
 
+	int3 index = chunk->getIndex();
 	chunk->startUpgrade();
+	++numJobsInFlight;
 	threadPool.enqueue(
 			boost::bind(
 				&ChunkManager::generate, this,
-				chunk->getIndex()));
+				index),
+			boost::bind(&ChunkManager::jobPriority, this, index),
+			boost::bind(&ChunkManager::cancel, this, index));
 }
 
 void ChunkManager::enqueueTesselation(ChunkPtr chunk) {
@@ -130,32 +396,91 @@ void ChunkManager::enqueueTesselation(ChunkPtr chunk) {
 
 	int3 index = chunk->getIndex();
 	chunk->startUpgrade();
+	++numJobsInFlight;
 	threadPool.enqueue(
 			boost::bind(
 				&ChunkManager::tesselate, this,
-				index, boost::cref(chunkMap)));
+				index, boost::cref(chunkMap), currentEpoch),
+			boost::bind(&ChunkManager::jobPriority, this, index),
+			boost::bind(&ChunkManager::cancel, this, index));
 }
 
-void ChunkManager::generate(int3 index) {
-	int3 position = chunkPositionFromIndex(index);
+void ChunkManager::skipTesselation(ChunkPtr chunk) {
+	BOOST_ASSERT(chunk->getState() == Chunk::GENERATED);
+	BOOST_ASSERT(!chunk->isUpgrading());
 
-	RawChunkData rawChunkData;
-	terrainGenerator->generateChunk(position, rawChunkData);
+	chunk->startUpgrade();
+	chunk->setGeometry(ChunkGeometryPtr(new ChunkGeometry()));
+	chunk->endUpgrade();
+	stats.tesselationsSkipped.increment();
+}
+
+float ChunkManager::jobPriority(int3 index) const {
+	vec3 const center = chunkCenter(index);
+	float priority = std::numeric_limits<float>::infinity();
+	for (unsigned i = 0; i < viewSpheres.size(); ++i) {
+		ViewSphere const &sphere = viewSpheres[i];
+		float const distanceOutside = distanceBetweenChunks(index - chunkIndexFromPoint(sphere.center)) - sphere.radius;
+		if (!isBeyondReach(distanceOutside)) {
+			priority = std::min(priority, length(center - sphere.center));
+		}
+	}
+	return priority;
+}
+
+void ChunkManager::cancel(int3 index) {
+	finalizerQueue.post(boost::bind(
+				&ChunkManager::finalizeCancellation, this, index));
+}
+
+void ChunkManager::finalizeCancellation(int3 index) {
+	TraceSpan span("finalizeCancellation", index);
+
+	ChunkPtr chunk = chunkMap[index];
+	chunk->endUpgrade();
+	--numJobsInFlight;
+	stats.irrelevantJobsSkipped.increment();
+}
+
+void ChunkManager::generate(int3 index) {
+	TraceSpan span("generate", index);
 
 	OctreePtr octree(new Octree());
-	buildOctree(rawChunkData, *octree);
+	if (!chunkStore || !chunkStore->load(index, *octree)) {
+		int3 position = chunkPositionFromIndex(index);
+
+		terrainGenerator->generateOctree(position, *octree);
+
+		if (chunkStore) {
+			chunkStore->save(index, *octree);
+		}
+	}
 
 	finalizerQueue.post(boost::bind(
 				&ChunkManager::finalizeGeneration, this, index, octree));
 }
 
 void ChunkManager::finalizeGeneration(int3 index, OctreePtr octree) {
+	TraceSpan span("finalizeGeneration", index);
+
 	ChunkPtr chunk = chunkMap[index];
 	chunk->setOctree(octree);
 	chunk->endUpgrade();
+	--numJobsInFlight;
+	loadedChunks.push_back(chunk);
+	if (octree->isEmpty()) {
+		// Air has no faces, whatever its neighbours are.
+		skipTesselation(chunk);
+	}
+	if (isBeyondReach(distanceOutsideSchedules(index))) {
+		stats.irrelevantJobsRun.increment();
+	}
 }
 
-void ChunkManager::tesselate(int3 index, ChunkMap const &chunkMap) {
+void ChunkManager::tesselate(int3 index, ChunkMap const &chunkMap, EpochPtr epoch) {
+	// The epoch is only held, so that the chunk map's garbage outlives our lookups.
+	TraceSpan span("tesselate", index);
+
 	ChunkGeometryPtr chunkGeometry(new ChunkGeometry());
 	::tesselate(index, chunkMap, chunkGeometry);
 
@@ -164,7 +489,13 @@ void ChunkManager::tesselate(int3 index, ChunkMap const &chunkMap) {
 }
 
 void ChunkManager::finalizeTesselation(int3 index, ChunkGeometryPtr chunkGeometry) {
+	TraceSpan span("finalizeTesselation", index);
+
 	ChunkPtr chunk = chunkMap[index];
 	chunk->setGeometry(chunkGeometry);
 	chunk->endUpgrade();
+	--numJobsInFlight;
+	if (isBeyondReach(distanceOutsideSchedules(index))) {
+		stats.irrelevantJobsRun.increment();
+	}
 }
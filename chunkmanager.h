@@ -2,6 +2,7 @@
 #define CHUNKMANAGER_H
 
 #include "chunk.h"
+#include "chunkmap.h"
 #include "maths.h"
 #include "octree.h"
 #include "threadpool.h"
@@ -11,6 +12,7 @@
 #include <boost/weak_ptr.hpp>
 
 #include <queue>
+#include <vector>
 
 struct ViewSphere {
 	vec3 center;
@@ -22,7 +24,9 @@ typedef boost::shared_ptr<ViewSphere> ViewSpherePtr;
 typedef boost::shared_ptr<ViewSphere const> ConstViewSpherePtr;
 typedef boost::weak_ptr<ViewSphere const> WeakConstViewSpherePtr;
 
-class ChunkMap;
+typedef std::vector<ViewSphere> ViewSpheres;
+
+class ChunkStore;
 class TerrainGenerator;
 
 class ChunkManager {
@@ -41,26 +45,95 @@ class ChunkManager {
 
 	typedef std::priority_queue<PrioritizedIndex> PriorityQueue;
 
+	/* The chunks that a view sphere wants, nearest first, as offsets from the chunk containing its center.
+	 * These are the chunks that the sphere might intersect, wherever in that chunk its center is.
+	 * Because the offsets are relative, they only need to be recomputed if the radius changes;
+	 * if the center moves into another chunk, only the bookkeeping of what is done gets reset.
+	 */
+	struct Schedule {
+		WeakConstViewSpherePtr viewSphere;
+		float radius;
+		std::vector<PrioritizedIndex> offsets;
+		int3 centerIndex;
+		unsigned numDone; // offsets before this one are known to be tesselated
+		unsigned next; // next offset to consider in the current call to sow()
+		Schedule(WeakConstViewSpherePtr viewSphere);
+	};
+
 	ChunkMap &chunkMap;
 
 	boost::scoped_ptr<TerrainGenerator> terrainGenerator;
-
-	std::vector<WeakConstViewSpherePtr> viewSpheres;
+	// Null if chunks are not stored.
+	boost::scoped_ptr<ChunkStore> chunkStore;
+
+	std::vector<Schedule> schedules;
+	// A copy of the view spheres as of the last call to sow(), for the job prioritizers.
+	// The thread pool only calls those from the main thread, when jobs are enqueued or reprioritized.
+	ViewSpheres viewSpheres;
+
+	unsigned const maxNumChunks;
+	unsigned long const maxChunkMemory;
+	// Chunks that are not in the NEW state, in no particular order.
+	// Only accessed from the main thread; this is what gets rendered.
+	std::vector<ChunkPtr> loadedChunks;
+
+	// Jobs whose finalizer has not run yet. Only accessed from the main thread.
+	unsigned numJobsInFlight;
+	// Chunks evicted since the chunk map was last compacted; their shells are likely still in it.
+	unsigned numEvictedSinceCompaction;
+
+	/* What the chunk map drops when compacted must outlive the jobs that might still be looking at it.
+	 * Each job that reads the map holds on to the epoch in which it was enqueued. An epoch holds the garbage
+	 * of the compaction that ended it, and the next epoch, because jobs that started earlier may also
+	 * have seen what later compactions drop. So garbage is freed once all jobs of its epoch and
+	 * of all earlier ones are done.
+	 */
+	struct Epoch
+	:
+		boost::noncopyable
+	{
+		ChunkMap::GarbagePtr garbage;
+		boost::shared_ptr<Epoch> next;
+	};
+	typedef boost::shared_ptr<Epoch> EpochPtr;
+	EpochPtr currentEpoch;
 
 	WorkQueue finalizerQueue;
 	ThreadPool threadPool;
 
 	public:
 
-		ChunkManager(ChunkMap &chunkMap, TerrainGenerator *terrainGenerator);
+		ChunkManager(ChunkMap &chunkMap, TerrainGenerator *terrainGenerator, unsigned numThreads = ThreadPool::defaultNumThreads());
+		~ChunkManager();
 
 		void addViewSphere(WeakConstViewSpherePtr viewSphere);
 
+		std::vector<ChunkPtr> const &getLoadedChunks() const { return loadedChunks; }
+
 		void sow();
 		void reap();
+		// Waits for some job to finish, unless none is in flight, and then reaps.
+		void waitAndReap();
+		void evict();
+
+		bool isComplete() const;
 
 	private:
 
+		static unsigned computeMaxNumChunks();
+		static float distanceBetweenChunks(int3 offset);
+
+		void updateSchedules();
+		bool nextScheduled(PrioritizedIndex *prioIndex, PriorityQueue &queue);
+		void skipDone(Schedule &schedule);
+
+		static bool isBeyondReach(float distanceOutside);
+		float distanceOutsideSchedules(int3 index) const;
+		bool isNeighbourhoodUpgrading(int3 index) const;
+		void compact();
+		bool isOverBudget(unsigned numChunks, unsigned long chunkMemory) const;
+		bool isBuried(int3 index) const;
+
 		bool tryUpgradeChunk(PrioritizedIndex prioIndex, PriorityQueue &queue);
 
 		OctreePtr octreeOrNull(int3 index);
@@ -69,10 +142,15 @@ class ChunkManager {
 		void enqueueGeneration(ChunkPtr chunk);
 		void enqueueTesselation(ChunkPtr chunk);
 		void enqueueLighting(ChunkPtr chunk);
+		void skipTesselation(ChunkPtr chunk);
+
+		float jobPriority(int3 index) const;
+		void cancel(int3 index);
+		void finalizeCancellation(int3 index);
 
 		void generate(int3 index);
 		void finalizeGeneration(int3 index, OctreePtr octree);
-		void tesselate(int3 index, ChunkMap const &chunkMap);
+		void tesselate(int3 index, ChunkMap const &chunkMap, EpochPtr epoch);
 		void finalizeTesselation(int3 index, ChunkGeometryPtr chunkGeometry);
 
 		template<typename T>
@@ -2,64 +2,166 @@
 
 #include "stats.h"
 
+unsigned const ChunkMap::INITIAL_CAPACITY = 1024;
+
+ChunkMap::Table::Table(unsigned capacity)
+:
+	mask(capacity - 1),
+	slots(new Slot[capacity])
+{
+	BOOST_ASSERT((capacity & mask) == 0);
+	for (unsigned i = 0; i < capacity; ++i) {
+		slots[i].store(0, boost::memory_order_relaxed);
+	}
+}
+
+struct ChunkMap::Garbage
+:
+	boost::noncopyable
+{
+	boost::ptr_vector<Table> tables;
+	std::vector<ChunkPtr> chunks;
+};
+
 ChunkMap::ChunkMap() {
+	tables.push_back(new Table(INITIAL_CAPACITY));
+	table.store(&tables.back(), boost::memory_order_release);
 }
 
 ChunkPtr ChunkMap::operator[](int3 index) {
-	boost::upgrade_lock<boost::shared_mutex> readLock(mapMutex);
-	PositionMap::iterator i = map.find(index);
-	if (i == map.end()) {
-		ChunkPtr chunk(new Chunk(index));
-		stats.chunksCreated.increment();
+	if (Chunk *chunk = find(index)) {
+		return chunk->shared_from_this();
+	}
 
-		{
-			boost::upgrade_to_unique_lock<boost::shared_mutex> writeLock(readLock);
+	boost::unique_lock<boost::mutex> lock(insertMutex);
+	// Someone may have beaten us to it while we were waiting for the lock.
+	if (Chunk *chunk = find(index)) {
+		return chunk->shared_from_this();
+	}
 
-			map[index] = chunk;
-		}
+	ChunkPtr chunk(new Chunk(index));
+	stats.chunksCreated.increment();
 
-		return chunk;
+	chunks.push_back(chunk);
+	if (2 * chunks.size() > tables.back().mask + 1) {
+		grow();
+	} else {
+		insertIntoTable(tables.back(), chunk.get());
 	}
-	return i->second;
+	return chunk;
 }
 
 ChunkConstPtr ChunkMap::operator[](int3 index) const {
-	boost::shared_lock<boost::shared_mutex> readLock(mapMutex);
-	PositionMap::const_iterator i = map.find(index);
-	if (i == map.end()) {
-		return ChunkConstPtr();
+	if (Chunk const *chunk = find(index)) {
+		return chunk->shared_from_this();
 	}
-	return i->second;
+	return ChunkConstPtr();
 }
 
 bool ChunkMap::contains(int3 index) const {
-	boost::shared_lock<boost::shared_mutex> readLock(mapMutex);
-	return map.find(index) != map.end();
+	return find(index) != 0;
 }
 
 OctreeConstPtr ChunkMap::getOctreeOrNull(int3 index) const {
-	boost::shared_lock<boost::shared_mutex> readLock(mapMutex);
-	PositionMap::const_iterator i = map.find(index);
-	if (i == map.end()) {
-		return OctreePtr();
+	if (Chunk const *chunk = find(index)) {
+		return chunk->getOctree();
 	}
-	return i->second->getOctree();
+	return OctreePtr();
 }
 
 Chunk::State ChunkMap::getChunkState(int3 index) const {
-	boost::shared_lock<boost::shared_mutex> readLock(mapMutex);
-	PositionMap::const_iterator i = map.find(index);
-	if (i == map.end()) {
-		return Chunk::NEW;
+	if (Chunk const *chunk = find(index)) {
+		return chunk->getState();
 	}
-	return i->second->getState();
+	return Chunk::NEW;
 }
 
 bool ChunkMap::isChunkUpgrading(int3 index) const {
-	boost::shared_lock<boost::shared_mutex> readLock(mapMutex);
-	PositionMap::const_iterator i = map.find(index);
-	if (i == map.end()) {
-		return false;
+	if (Chunk const *chunk = find(index)) {
+		return chunk->isUpgrading();
+	}
+	return false;
+}
+
+Chunk *ChunkMap::find(int3 index) const {
+	return findInTable(*table.load(boost::memory_order_acquire), index);
+}
+
+Chunk *ChunkMap::findInTable(Table const &table, int3 index) {
+	static CoordsHasher hasher;
+	for (unsigned i = hasher(index) & table.mask;; i = (i + 1) & table.mask) {
+		Chunk *chunk = table.slots[i].load(boost::memory_order_acquire);
+		if (!chunk) {
+			return 0;
+		}
+		if (chunk->getIndex() == index) {
+			return chunk;
+		}
+	}
+}
+
+void ChunkMap::insertIntoTable(Table &table, Chunk *chunk) {
+	static CoordsHasher hasher;
+	for (unsigned i = hasher(chunk->getIndex()) & table.mask;; i = (i + 1) & table.mask) {
+		if (!table.slots[i].load(boost::memory_order_relaxed)) {
+			table.slots[i].store(chunk, boost::memory_order_release);
+			return;
+		}
+	}
+}
+
+unsigned ChunkMap::size() const {
+	boost::unique_lock<boost::mutex> lock(insertMutex);
+	return chunks.size();
+}
+
+unsigned long ChunkMap::getSizeInBytes() const {
+	boost::unique_lock<boost::mutex> lock(insertMutex);
+	unsigned long size = chunks.capacity() * sizeof(ChunkPtr);
+	for (unsigned i = 0; i < tables.size(); ++i) {
+		size += sizeof(Table) + (tables[i].mask + 1) * sizeof(Slot);
+	}
+	return size;
+}
+
+ChunkMap::GarbagePtr ChunkMap::compact() {
+	GarbagePtr garbage(new Garbage());
+	boost::unique_lock<boost::mutex> lock(insertMutex);
+	unsigned j = 0;
+	for (unsigned i = 0; i < chunks.size(); ++i) {
+		Chunk const &chunk = *chunks[i];
+		// A chunk that is referenced elsewhere must stay, or a later lookup would create a second one.
+		if (chunk.getState() == Chunk::NEW && !chunk.isUpgrading() && chunks[i].unique()) {
+			garbage->chunks.push_back(chunks[i]);
+			continue;
+		}
+		chunks[j++] = chunks[i];
+	}
+	chunks.resize(j);
+	std::vector<ChunkPtr>(chunks).swap(chunks);
+
+	unsigned capacity = INITIAL_CAPACITY;
+	while (2 * chunks.size() > capacity) {
+		capacity *= 2;
+	}
+	// Lookups may still be probing the old tables, so they go out with the garbage.
+	garbage->tables.transfer(garbage->tables.end(), tables);
+	rebuild(capacity);
+	return garbage;
+}
+
+void ChunkMap::grow() {
+	// Must be called with insertMutex held.
+	// The old table is not deleted, because lookups might still be using it.
+	rebuild(2 * (tables.back().mask + 1));
+}
+
+void ChunkMap::rebuild(unsigned capacity) {
+	// Must be called with insertMutex held.
+	tables.push_back(new Table(capacity));
+	Table &newTable = tables.back();
+	for (unsigned i = 0; i < chunks.size(); ++i) {
+		insertIntoTable(newTable, chunks[i].get());
 	}
-	return i->second->isUpgrading();
+	table.store(&newTable, boost::memory_order_release);
 }
@@ -5,29 +5,78 @@
 #include "chunk.h"
 #include "maths.h"
 
+#include <boost/atomic.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/unordered_map.hpp>
 
+#include <stdint.h>
+
+#include <vector>
+
+/* Hashes chunk indices.
+ * Each coordinate is multiplied by a different odd constant, so that permutations of the same
+ * coordinates end up in different buckets, and the sum is run through the MurmurHash3 finalizer
+ * so that the low bits, which pick the slot in ChunkMap, depend on all bits of all coordinates.
+ */
 struct CoordsHasher {
 	size_t operator()(int3 p) const {
-		static boost::hash<float> hasher;
-		return hasher(p.x) ^ hasher(p.y) ^ hasher(p.z);
+		uint64_t h =
+			(uint64_t)(uint32_t)p.x * 0x9E3779B97F4A7C15ULL +
+			(uint64_t)(uint32_t)p.y * 0xC2B2AE3D27D4EB4FULL +
+			(uint64_t)(uint32_t)p.z * 0x165667B19E3779F9ULL;
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 33;
+		return (size_t)h;
 	}
 };
 
+/* Maps chunk indices to chunks.
+ *
+ * Lookups are lock-free: the map is an open-addressing hash table with linear probing,
+ * whose slots are atomic pointers that are only ever changed from null to a chunk.
+ * Insertions are serialized by a mutex. When the table fills up, a larger copy is published,
+ * and the old one is retired rather than deleted, because concurrent lookups may still be probing it.
+ * Chunks are only removed by compact(), which publishes a fresh table without them. The removed chunks
+ * and all retired tables are handed to the caller as garbage, to be kept until every lookup that
+ * might have started before the compaction is done.
+ *
+ * Only the map itself is synchronized; access to the chunks' contents is not.
+ */
 class ChunkMap
 :
 	boost::noncopyable
 {
 
-	typedef boost::unordered_map<int3, ChunkPtr, CoordsHasher> PositionMap;
+	typedef boost::atomic<Chunk*> Slot;
+
+	struct Table
+	:
+		boost::noncopyable
+	{
+		unsigned const mask;
+		boost::scoped_array<Slot> slots;
+		Table(unsigned capacity);
+	};
+
+	static unsigned const INITIAL_CAPACITY;
+
+	boost::atomic<Table const*> table;
 
-	boost::shared_mutex mutable mapMutex;
-	PositionMap map;
+	boost::mutex mutable insertMutex;
+	boost::ptr_vector<Table> tables;
+	std::vector<ChunkPtr> chunks;
 
 	public:
 
+		struct Garbage;
+		typedef boost::shared_ptr<Garbage> GarbagePtr;
+
 		ChunkMap();
 
 		ChunkPtr operator[](int3 index);
@@ -38,6 +87,25 @@ class ChunkMap
 		OctreeConstPtr getOctreeOrNull(int3 index) const;
 		bool isChunkUpgrading(int3 index) const;
 
+		// The number of chunks in the map, including the shells of evicted ones.
+		unsigned size() const;
+		// The memory used by the map's tables, live and retired, not counting the chunks themselves.
+		unsigned long getSizeInBytes() const;
+
+		/* Removes the chunks that are NEW, not upgrading, and not referenced from outside the map,
+		 * and replaces all tables by a single one that fits the remaining chunks.
+		 * Lookups may run concurrently, so what was removed is returned rather than freed.
+		 */
+		GarbagePtr compact();
+
+	private:
+
+		Chunk *find(int3 index) const;
+		static Chunk *findInTable(Table const &table, int3 index);
+		static void insertIntoTable(Table &table, Chunk *chunk);
+		void grow();
+		void rebuild(unsigned capacity);
+
 };
 
 #endif
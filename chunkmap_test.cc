@@ -0,0 +1,171 @@
+#include "chunkmap.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(ChunkMapTest)
+
+BOOST_AUTO_TEST_CASE(TestCreateOnDemand) {
+	ChunkMap chunkMap;
+	ChunkMap const &constChunkMap = chunkMap;
+	int3 const index(1, -2, 3);
+	BOOST_REQUIRE(!chunkMap.contains(index));
+	BOOST_REQUIRE(!constChunkMap[index]);
+
+	ChunkPtr chunk = chunkMap[index];
+	BOOST_REQUIRE(chunk);
+	BOOST_REQUIRE(chunk->getIndex() == index);
+	BOOST_REQUIRE(chunkMap.contains(index));
+	BOOST_REQUIRE_EQUAL(chunk, chunkMap[index]);
+	BOOST_REQUIRE_EQUAL(ChunkConstPtr(chunk), constChunkMap[index]);
+}
+
+BOOST_AUTO_TEST_CASE(TestPermutationsAreDistinct) {
+	ChunkMap chunkMap;
+	ChunkPtr a = chunkMap[int3(1, 2, 3)];
+	ChunkPtr b = chunkMap[int3(3, 2, 1)];
+	ChunkPtr c = chunkMap[int3(2, 3, 1)];
+	BOOST_REQUIRE(a != b);
+	BOOST_REQUIRE(b != c);
+	BOOST_REQUIRE(a != c);
+	BOOST_REQUIRE(chunkMap[int3(3, 2, 1)]->getIndex() == int3(3, 2, 1));
+}
+
+BOOST_AUTO_TEST_CASE(TestGrow) {
+	ChunkMap chunkMap;
+	int const r = 10;
+	for (int z = -r; z < r; ++z) {
+		for (int y = -r; y < r; ++y) {
+			for (int x = -r; x < r; ++x) {
+				chunkMap[int3(x, y, z)];
+			}
+		}
+	}
+	ChunkMap const &constChunkMap = chunkMap;
+	for (int z = -r; z < r; ++z) {
+		for (int y = -r; y < r; ++y) {
+			for (int x = -r; x < r; ++x) {
+				ChunkConstPtr chunk = constChunkMap[int3(x, y, z)];
+				BOOST_REQUIRE(chunk);
+				BOOST_REQUIRE(chunk->getIndex() == int3(x, y, z));
+			}
+		}
+	}
+	BOOST_REQUIRE(!constChunkMap[int3(r, r, r)]);
+}
+
+BOOST_AUTO_TEST_CASE(TestCompact) {
+	ChunkMap chunkMap;
+	chunkMap[int3(0, 0, 0)];
+	ChunkPtr generated = chunkMap[int3(1, 0, 0)];
+	generated->startUpgrade();
+	generated->endUpgrade();
+	ChunkPtr referenced = chunkMap[int3(2, 0, 0)];
+	generated.reset();
+	BOOST_REQUIRE_EQUAL(3u, chunkMap.size());
+
+	// Only the NEW chunk that nobody else holds on to can go.
+	chunkMap.compact();
+	BOOST_REQUIRE_EQUAL(2u, chunkMap.size());
+	BOOST_REQUIRE(!chunkMap.contains(int3(0, 0, 0)));
+	BOOST_REQUIRE_EQUAL(Chunk::GENERATED, chunkMap.getChunkState(int3(1, 0, 0)));
+	BOOST_REQUIRE_EQUAL(referenced, chunkMap[int3(2, 0, 0)]);
+
+	chunkMap[int3(1, 0, 0)]->evict();
+	referenced.reset();
+	chunkMap.compact();
+	BOOST_REQUIRE_EQUAL(0u, chunkMap.size());
+	BOOST_REQUIRE(!chunkMap.contains(int3(1, 0, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(TestCompactFreesRetiredTables) {
+	ChunkMap chunkMap;
+	unsigned long const emptySize = chunkMap.getSizeInBytes();
+	int const n = 10000;
+	for (int x = 0; x < n; ++x) {
+		chunkMap[int3(x, 0, 0)];
+	}
+	BOOST_REQUIRE_GT(chunkMap.getSizeInBytes(), emptySize);
+
+	chunkMap.compact();
+	BOOST_REQUIRE_EQUAL(0u, chunkMap.size());
+	BOOST_REQUIRE_EQUAL(emptySize, chunkMap.getSizeInBytes());
+
+	// The map still works after being compacted.
+	for (int x = 0; x < n; ++x) {
+		chunkMap[int3(x, 0, 0)];
+	}
+	BOOST_REQUIRE_EQUAL((unsigned)n, chunkMap.size());
+	for (int x = 0; x < n; ++x) {
+		BOOST_REQUIRE(chunkMap.contains(int3(x, 0, 0)));
+	}
+}
+
+namespace {
+	void lookUpWhileInserting(ChunkMap const *chunkMap, int n, bool *ok) {
+		for (int i = 0; i < 100; ++i) {
+			for (int x = 0; x < n; ++x) {
+				ChunkConstPtr chunk = (*chunkMap)[int3(x, 0, 0)];
+				if (chunk && chunk->getIndex() != int3(x, 0, 0)) {
+					*ok = false;
+				}
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestConcurrentLookups) {
+	ChunkMap chunkMap;
+	int const n = 10000;
+	bool ok[4] = { true, true, true, true };
+	boost::thread_group readers;
+	for (unsigned i = 0; i < 4; ++i) {
+		readers.create_thread(boost::bind(&lookUpWhileInserting, &chunkMap, n, &ok[i]));
+	}
+	for (int x = 0; x < n; ++x) {
+		chunkMap[int3(x, 0, 0)];
+	}
+	readers.join_all();
+	for (unsigned i = 0; i < 4; ++i) {
+		BOOST_REQUIRE(ok[i]);
+	}
+	for (int x = 0; x < n; ++x) {
+		BOOST_REQUIRE(chunkMap.contains(int3(x, 0, 0)));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestCompactWhileLookingUp) {
+	ChunkMap chunkMap;
+	int const n = 10000;
+	for (int x = 0; x < n; ++x) {
+		chunkMap[int3(x, 0, 0)];
+	}
+	// Keep the even chunks, so the lookups find some and miss others.
+	std::vector<ChunkPtr> kept;
+	for (int x = 0; x < n; x += 2) {
+		kept.push_back(chunkMap[int3(x, 0, 0)]);
+	}
+	bool ok[4] = { true, true, true, true };
+	ChunkMap::GarbagePtr garbage;
+	{
+		boost::thread_group readers;
+		for (unsigned i = 0; i < 4; ++i) {
+			readers.create_thread(boost::bind(&lookUpWhileInserting, &chunkMap, n, &ok[i]));
+		}
+		// The readers may still be probing what was removed until they are joined.
+		garbage = chunkMap.compact();
+		readers.join_all();
+	}
+	garbage.reset();
+	for (unsigned i = 0; i < 4; ++i) {
+		BOOST_REQUIRE(ok[i]);
+	}
+	// Chunks that a reader held on to at the time were rightly kept; now nobody does.
+	chunkMap.compact();
+	BOOST_REQUIRE_EQUAL(kept.size(), chunkMap.size());
+	for (int x = 0; x < n; ++x) {
+		BOOST_REQUIRE_EQUAL(x % 2 == 0, chunkMap.contains(int3(x, 0, 0)));
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
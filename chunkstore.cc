@@ -0,0 +1,263 @@
+#include "chunkstore.h"
+
+#include "stats.h"
+
+#include <boost/static_assert.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+unsigned const ChunkStore::REGION_POWER = 2;
+unsigned const ChunkStore::REGION_SIZE = 1 << REGION_POWER;
+
+namespace {
+
+	char const MAGIC[4] = { 'K', 'F', 'R', 'G' };
+	uint32_t const VERSION = 3;
+
+	// Part of the file format; not necessarily the page size of the machine, but a multiple of it on most.
+	unsigned const PAGE_SIZE = 4096;
+	unsigned const HEADER_SIZE = 32;
+	unsigned const ENTRY_SIZE = 16;
+	unsigned const NODE_SIZE = 4 * 2;
+
+	unsigned const MAX_MAPPINGS = 64;
+
+	void putUint32(char *p, uint32_t value) {
+		for (unsigned i = 0; i < 4; ++i) {
+			p[i] = (char)(value >> (8 * i));
+		}
+	}
+
+	uint32_t getUint32(char const *p) {
+		uint32_t value = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			value |= (uint32_t)(unsigned char)p[i] << (8 * i);
+		}
+		return value;
+	}
+
+	void putUint64(char *p, uint64_t value) {
+		putUint32(p, (uint32_t)value);
+		putUint32(p + 4, (uint32_t)(value >> 32));
+	}
+
+	uint64_t getUint64(char const *p) {
+		return getUint32(p) | ((uint64_t)getUint32(p + 4) << 32);
+	}
+
+	bool canMapNodes() {
+		uint32_t const one = 1;
+		return sizeof(OctreeNode) == NODE_SIZE && *(unsigned char const*)&one == 1;
+	}
+
+	int3 regionIndexFromChunkIndex(int3 index) {
+		// Like chunkIndexFromPosition, relies on arithmetic shifts for negative numbers.
+		return int3(index.x >> ChunkStore::REGION_POWER, index.y >> ChunkStore::REGION_POWER, index.z >> ChunkStore::REGION_POWER);
+	}
+
+	unsigned entryOffset(int3 index) {
+		int const mask = ChunkStore::REGION_SIZE - 1;
+		unsigned const entry =
+			(index.x & mask) +
+			ChunkStore::REGION_SIZE * ((index.y & mask) +
+			ChunkStore::REGION_SIZE * (index.z & mask));
+		return HEADER_SIZE + entry * ENTRY_SIZE;
+	}
+
+	void encodeHeader(char *header, unsigned seed, int3 regionIndex) {
+		memset(header, 0, HEADER_SIZE);
+		memcpy(header, MAGIC, sizeof(MAGIC));
+		putUint32(header + 4, VERSION);
+		putUint32(header + 8, seed);
+		putUint32(header + 12, (uint32_t)regionIndex.x);
+		putUint32(header + 16, (uint32_t)regionIndex.y);
+		putUint32(header + 20, (uint32_t)regionIndex.z);
+	}
+
+	bool checkHeader(char const *header, unsigned seed, int3 regionIndex) {
+		char expected[HEADER_SIZE];
+		encodeHeader(expected, seed, regionIndex);
+		return memcmp(header, expected, HEADER_SIZE) == 0;
+	}
+
+}
+
+struct ChunkStore::Mapping
+:
+	boost::noncopyable
+{
+	char const *data;
+	unsigned long size;
+	Mapping(char const *data, unsigned long size) : data(data), size(size) { }
+	~Mapping() { munmap(const_cast<char*>(data), size); }
+};
+
+ChunkStore::ChunkStore(std::string const &directory, unsigned seed)
+:
+	directory(directory),
+	seed(seed)
+{
+	BOOST_STATIC_ASSERT(HEADER_SIZE + REGION_SIZE * REGION_SIZE * REGION_SIZE * ENTRY_SIZE <= PAGE_SIZE);
+	// If this fails for any reason other than that it already exists, we will find out soon enough.
+	mkdir(directory.c_str(), 0755);
+}
+
+bool ChunkStore::load(int3 index, Octree &octree) {
+	int3 const regionIndex = regionIndexFromChunkIndex(index);
+	std::string const fileName = getRegionFileName(regionIndex);
+
+	boost::unique_lock<boost::mutex> lock(mutex);
+	MappingPtr mapping = mappings[fileName];
+	if (!mapping) {
+		mapping = mapRegion(fileName, regionIndex, PAGE_SIZE);
+		if (!mapping) {
+			return false;
+		}
+	}
+
+	// The table is in the mapped header page, so it shows what has been saved since.
+	char const *entry = mapping->data + entryOffset(index);
+	uint64_t const offset = getUint64(entry);
+	uint32_t const numNodes = getUint32(entry + 8);
+	if (offset == 0) {
+		return false;
+	}
+	if (offset + (uint64_t)numNodes * NODE_SIZE > mapping->size) {
+		// Saved after we mapped the file.
+		mapping = mapRegion(fileName, regionIndex, offset + (uint64_t)numNodes * NODE_SIZE);
+		if (!mapping) {
+			return false;
+		}
+	}
+	char const *data = mapping->data + offset;
+
+	// A truncated or corrupt file must not send walks over the octree out of bounds;
+	// rejecting it gets the chunk generated afresh.
+	if (canMapNodes()) {
+		OctreeNode const *nodes = reinterpret_cast<OctreeNode const*>(data);
+		if (!isValidOctree(nodes, numNodes)) {
+			return false;
+		}
+		octree.setExternalNodes(nodes, numNodes, mapping);
+	} else {
+		OctreeNodes nodes(numNodes);
+		for (unsigned i = 0; i < numNodes; ++i) {
+			char const *p = data + i * NODE_SIZE;
+			nodes[i].block = getUint32(p);
+			nodes[i].children = getUint32(p + 4);
+		}
+		if (!isValidOctree(nodes.empty() ? 0 : &nodes[0], numNodes)) {
+			return false;
+		}
+		octree = Octree();
+		octree.getNodes().swap(nodes);
+	}
+	stats.chunksLoaded.increment();
+	return true;
+}
+
+void ChunkStore::save(int3 index, Octree const &octree) {
+	int3 const regionIndex = regionIndexFromChunkIndex(index);
+	std::string const fileName = getRegionFileName(regionIndex);
+	unsigned const numNodes = octree.getNumNodes();
+	OctreeNode const *nodes = octree.getNodeData();
+
+	std::vector<char> data(numNodes * NODE_SIZE);
+	for (unsigned i = 0; i < numNodes; ++i) {
+		char *p = &data[i * NODE_SIZE];
+		putUint32(p, nodes[i].block);
+		putUint32(p + 4, nodes[i].children);
+	}
+
+	boost::unique_lock<boost::mutex> lock(mutex);
+	std::fstream file(fileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+	char header[HEADER_SIZE];
+	if (!file || !file.read(header, HEADER_SIZE) || !checkHeader(header, seed, regionIndex)) {
+		// Start a new region file with an empty table. Unlink rather than truncate any old file,
+		// because truncating a file that is still mapped would pull the pages out from under its octrees.
+		file.close();
+		remove(fileName.c_str());
+		mappings.erase(fileName);
+		std::vector<char> emptyRegion(PAGE_SIZE, 0);
+		encodeHeader(&emptyRegion[0], seed, regionIndex);
+		std::ofstream newFile(fileName.c_str(), std::ios::out | std::ios::binary);
+		newFile.write(&emptyRegion[0], emptyRegion.size());
+		newFile.close();
+		file.clear();
+		file.open(fileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+		if (!file) {
+			return;
+		}
+	}
+
+	file.seekp(0, std::ios::end);
+	uint64_t const end = file.tellp();
+	uint64_t const offset = (end + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	std::vector<char> padding(offset - end, 0);
+	if (!padding.empty()) {
+		file.write(&padding[0], padding.size());
+	}
+	if (!data.empty()) {
+		file.write(&data[0], data.size());
+	}
+	file.flush();
+
+	// Only point the table at the octree once it is completely written.
+	char entry[ENTRY_SIZE];
+	memset(entry, 0, ENTRY_SIZE);
+	putUint64(entry, offset);
+	putUint32(entry + 8, numNodes);
+	file.seekp(entryOffset(index));
+	file.write(entry, ENTRY_SIZE);
+	file.flush();
+	if (file) {
+		stats.chunksSaved.increment();
+	}
+}
+
+std::string ChunkStore::getRegionFileName(int3 regionIndex) const {
+	std::ostringstream fileName;
+	fileName << directory << '/' << seed << '.' << regionIndex.x << '.' << regionIndex.y << '.' << regionIndex.z << ".region";
+	return fileName.str();
+}
+
+ChunkStore::MappingPtr ChunkStore::mapRegion(std::string const &fileName, int3 regionIndex, unsigned long minSize) {
+	// Must be called with mutex held.
+	MappingPtr mapping;
+	int const fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return mapping;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) == 0 && (unsigned long)fileStat.st_size >= minSize) {
+		unsigned long const size = fileStat.st_size;
+		void *data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED) {
+			mapping.reset(new Mapping(static_cast<char const*>(data), size));
+		}
+	}
+	close(fd);
+
+	if (mapping && !checkHeader(mapping->data, seed, regionIndex)) {
+		mapping.reset();
+	}
+	if (mappings.size() >= MAX_MAPPINGS) {
+		mappings.clear();
+	}
+	if (mapping) {
+		mappings[fileName] = mapping;
+	} else {
+		mappings.erase(fileName);
+	}
+	return mapping;
+}
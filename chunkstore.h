@@ -0,0 +1,62 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include "maths.h"
+#include "octree.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <map>
+#include <string>
+
+/* Keeps octrees on disk, so that chunks need not be generated again in a later run,
+ * or when the camera comes back to a region whose chunks have been evicted.
+ *
+ * Chunks are grouped into region files of REGION_SIZE^3 chunks, one file per region per seed.
+ * A region file starts with a header page, holding a table with an entry for each chunk in the region
+ * that gives the offset and number of nodes of its octree, or offset zero if it is not stored.
+ * Octrees are appended to the end of the file, each starting on a page boundary.
+ * Nodes are stored as two little-endian 32-bit numbers: the block, then the packed children.
+ *
+ * That is exactly how OctreeNode is laid out in memory on little-endian machines,
+ * so there the region files are memory-mapped and octrees point straight into them;
+ * loading a chunk costs a few page faults when it is first used. Elsewhere, nodes are copied.
+ *
+ * Thread-safe; file access is serialized.
+ */
+class ChunkStore
+:
+	boost::noncopyable
+{
+
+	struct Mapping;
+	typedef boost::shared_ptr<Mapping const> MappingPtr;
+
+	std::string const directory;
+	unsigned const seed;
+
+	boost::mutex mutex;
+	// The most recent mapping of each region file. Octrees keep their own mappings alive.
+	std::map<std::string, MappingPtr> mappings;
+
+	public:
+
+		static unsigned const REGION_POWER;
+		static unsigned const REGION_SIZE;
+
+		ChunkStore(std::string const &directory, unsigned seed);
+
+		// Returns false, and leaves the octree untouched, if the chunk is not stored.
+		bool load(int3 index, Octree &octree);
+		void save(int3 index, Octree const &octree);
+
+	private:
+
+		std::string getRegionFileName(int3 regionIndex) const;
+		MappingPtr mapRegion(std::string const &fileName, int3 regionIndex, unsigned long minSize);
+
+};
+
+#endif
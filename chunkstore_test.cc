@@ -0,0 +1,113 @@
+#include "chunkstore.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib>
+#include <string>
+
+BOOST_AUTO_TEST_SUITE(ChunkStoreTest)
+
+namespace {
+
+	std::string makeTempDirectory() {
+		char name[] = "/tmp/chunkstore_test.XXXXXX";
+		BOOST_REQUIRE(mkdtemp(name));
+		return name;
+	}
+
+	void makeOctree(Octree &octree, Block block) {
+		OctreeNodes &nodes = octree.getNodes();
+		nodes.push_back(OctreeNode());
+		nodes.push_back(OctreeNode(block));
+		nodes.push_back(OctreeNode(STONE_BLOCK));
+		nodes[0].setChildren(1, (1 << 3) | (1 << 7));
+	}
+
+	void checkEqual(Octree const &a, Octree const &b) {
+		BOOST_REQUIRE_EQUAL(a.getNumNodes(), b.getNumNodes());
+		for (unsigned i = 0; i < a.getNumNodes(); ++i) {
+			BOOST_CHECK_EQUAL(a.getNode(i).block, b.getNode(i).block);
+			BOOST_CHECK_EQUAL(a.getNode(i).children, b.getNode(i).children);
+		}
+	}
+
+}
+
+BOOST_AUTO_TEST_CASE(TestRoundTrip) {
+	std::string const directory = makeTempDirectory();
+	Octree a, b, empty;
+	makeOctree(a, 5);
+	makeOctree(b, 6);
+	{
+		ChunkStore store(directory, 4);
+		Octree loaded;
+		BOOST_CHECK(!store.load(int3(-1, 0, 0), loaded));
+		BOOST_CHECK(loaded.isEmpty());
+		store.save(int3(-1, 0, 0), a);
+		// Same region as the one above.
+		store.save(int3(-2, 1, 0), b);
+		// Different region.
+		store.save(int3(0, 0, 0), empty);
+	}
+	{
+		ChunkStore store(directory, 4);
+		Octree loadedA, loadedB, loadedEmpty;
+		BOOST_REQUIRE(store.load(int3(-1, 0, 0), loadedA));
+		checkEqual(a, loadedA);
+		BOOST_REQUIRE(store.load(int3(-2, 1, 0), loadedB));
+		checkEqual(b, loadedB);
+		BOOST_REQUIRE(store.load(int3(0, 0, 0), loadedEmpty));
+		BOOST_CHECK(loadedEmpty.isEmpty());
+		Octree missing;
+		BOOST_CHECK(!store.load(int3(-3, 0, 0), missing));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestLoadWhileSaving) {
+	std::string const directory = makeTempDirectory();
+	ChunkStore store(directory, 4);
+	Octree a, b;
+	makeOctree(a, 5);
+	makeOctree(b, 6);
+	Octree loadedA, loadedB;
+	store.save(int3(0, 0, 0), a);
+	BOOST_REQUIRE(store.load(int3(0, 0, 0), loadedA));
+	// Grows the file beyond what is mapped for loadedA.
+	store.save(int3(1, 0, 0), b);
+	BOOST_REQUIRE(store.load(int3(1, 0, 0), loadedB));
+	checkEqual(a, loadedA);
+	checkEqual(b, loadedB);
+}
+
+BOOST_AUTO_TEST_CASE(TestSeedsAreSeparate) {
+	std::string const directory = makeTempDirectory();
+	Octree octree;
+	makeOctree(octree, 5);
+	ChunkStore(directory, 4).save(int3(1, 2, 3), octree);
+	Octree loaded;
+	BOOST_CHECK(!ChunkStore(directory, 5).load(int3(1, 2, 3), loaded));
+	BOOST_CHECK(ChunkStore(directory, 4).load(int3(1, 2, 3), loaded));
+}
+
+BOOST_AUTO_TEST_CASE(TestRejectsCorruptOctrees) {
+	std::string const directory = makeTempDirectory();
+	ChunkStore store(directory, 4);
+	Octree outOfBounds, backwards, childless;
+	makeOctree(outOfBounds, 5);
+	outOfBounds.getNodes()[0].setChildren(2, (1 << 3) | (1 << 7));
+	makeOctree(backwards, 5);
+	backwards.getNodes()[0].setChildren(0, (1 << 3) | (1 << 7));
+	makeOctree(childless, 5);
+	childless.getNodes()[0].setChildren(1, 0);
+	store.save(int3(0, 0, 0), outOfBounds);
+	store.save(int3(1, 0, 0), backwards);
+	store.save(int3(2, 0, 0), childless);
+
+	Octree loaded;
+	BOOST_CHECK(!store.load(int3(0, 0, 0), loaded));
+	BOOST_CHECK(!store.load(int3(1, 0, 0), loaded));
+	BOOST_CHECK(!store.load(int3(2, 0, 0), loaded));
+	BOOST_CHECK(loaded.isEmpty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -22,11 +22,14 @@ po::options_description const &getOptionsDescription() {
 			("exit_after", po::value<unsigned>(&flags.exitAfter)->default_value(0), "terminate after this many frames")
 			("seed", po::value<unsigned>(&flags.seed)->default_value(4), "seed for world generation")
 			("view_distance", po::value<unsigned>(&flags.viewDistance)->default_value(64), "view depth in blocks")
-			("max_num_chunks", po::value<unsigned>(&flags.maxNumChunks)->default_value(0), "maximum number of chunks to hold in memory at any given time")
+			("max_num_chunks", po::value<unsigned>(&flags.maxNumChunks)->default_value(0), "maximum number of chunks to hold in memory at any given time (0 to derive from view distance)")
+			("max_chunk_memory", po::value<unsigned>(&flags.maxChunkMemory)->default_value(0), "maximum memory used by chunk data and geometry (MiB, 0 for unlimited)")
+			("chunk_store", po::value<std::string>(&flags.chunkStore)->default_value(""), "directory in which to keep generated chunks for later runs (empty to always generate)")
 			("start_x", po::value<float>(&flags.startX)->default_value(0.0f), "x coordinate of start point")
 			("start_y", po::value<float>(&flags.startY)->default_value(0.0f), "y coordinate of start point")
 			("start_z", po::value<float>(&flags.startZ)->default_value(0.0f), "z coordinate of start point")
 			("bent_normals", po::value<bool>(&flags.bentNormals)->default_value(true), "use raycasting to compute bent normals for better lighting")
+			("greedy_meshing", po::bool_switch(&flags.greedyMeshing), "merge adjacent faces with the same block and normals into larger quads")
 			("start_time", po::value<float>(&flags.startTime)->default_value(12.0f), "start time of day (0-24)")
 			("day_length", po::value<float>(&flags.dayLength)->default_value(0.0f), "day length (seconds)")
 			("skip_night", po::bool_switch(&flags.skipNight), "shortly after sunset, jump forward to shortly before sunrise")
@@ -45,7 +48,14 @@ po::options_description const &getOptionsDescription() {
 			("mie_directionality", po::value<float>(&flags.mieDirectionality)->default_value(0.7f), "Mie directonality (-1 backwards ... 0 symmetric ... 1 forwards)") // Bruneton and Neyret: 0.76f
 			("atmosphere_layers", po::value<unsigned>(&flags.atmosphereLayers)->default_value(8), "number of layers for atmosphere rendering")
 			("atmosphere_angles", po::value<unsigned>(&flags.atmosphereAngles)->default_value(256), "number of angles for atmosphere tables")
+			("trace_file", po::value<std::string>(&flags.traceFile)->default_value(""), "record a timeline of frames and chunk jobs, and write it to this file on exit in Chrome trace format")
 			("benchmark_size", po::value<unsigned>(&flags.benchmarkSize)->default_value(5), "size of benchmark cube (will be NxNxN chunks)")
+			("benchmark_warmup", po::value<unsigned>(&flags.benchmarkWarmup)->default_value(1), "number of benchmark runs to discard before measuring")
+			("benchmark_repetitions", po::value<unsigned>(&flags.benchmarkRepetitions)->default_value(3), "number of measured benchmark runs")
+			("benchmark_format", po::value<std::string>(&flags.benchmarkFormat)->default_value("json"), "format of benchmark results (json or csv)")
+			("benchmark_hasher", po::bool_switch(&flags.benchmarkHasher), "benchmark chunk index hashing over a view-distance-sized cube instead of generation")
+			("benchmark_pregen", po::bool_switch(&flags.benchmarkPregen), "pre-generate the view sphere around the start point on all cores, and report how it scales with the number of threads")
+			("benchmark_max_threads", po::value<unsigned>(&flags.benchmarkMaxThreads)->default_value(0), "maximum number of threads for --benchmark_pregen (0 for the number of cores)")
 		;
 		initialized = true;
 	}
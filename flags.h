@@ -1,6 +1,8 @@
 #ifndef FLAGS_H
 #define FLAGS_H
 
+#include <string>
+
 struct Flags {
 	bool help;
 	bool mouseLook;
@@ -12,10 +14,13 @@ struct Flags {
 	unsigned seed;
 	unsigned viewDistance;
 	unsigned maxNumChunks;
+	unsigned maxChunkMemory;
+	std::string chunkStore;
 	float startX;
 	float startY;
 	float startZ;
 	bool bentNormals;
+	bool greedyMeshing;
 	float startTime;
 	float dayLength;
 	bool skipNight;
@@ -34,9 +39,16 @@ struct Flags {
 	float mieDirectionality;
 	unsigned atmosphereLayers;
 	unsigned atmosphereAngles;
+	std::string traceFile;
 
 	// Benchmark flags
 	unsigned benchmarkSize;
+	unsigned benchmarkWarmup;
+	unsigned benchmarkRepetitions;
+	std::string benchmarkFormat;
+	bool benchmarkHasher;
+	bool benchmarkPregen;
+	unsigned benchmarkMaxThreads;
 };
 
 extern Flags flags;
@@ -1,16 +1,25 @@
 #include "geometry.h"
 
-#include "chunkdata.h"
 #include "chunkmap.h"
 #include "flags.h"
+#include "octree.h"
 #include "raycaster.h"
+#include "rowmask.h"
 #include "stats.h"
+#include "threading.h"
 
 #include <boost/unordered_map.hpp>
 
 #include <algorithm>
 #include <vector>
 
+/* Remembers the partial bent normals computed at each vertex position, so that the faces sharing a vertex share the raycasts.
+ *
+ * Positions are looked up in an open-addressing hash table with linear probing, which grows with the number of
+ * vertices in a chunk rather than covering every vertex position in it. Each slot is stamped with the generation
+ * it was written in, and clear() starts a new generation, so a slot from an earlier chunk counts as empty
+ * without anything having to be overwritten. The table and the results keep their memory between chunks.
+ */
 class RaycastCache {
 
 	struct ResultsForPos {
@@ -28,25 +37,37 @@ class RaycastCache {
 		}
 	};
 
+	struct Slot {
+		unsigned generation;
+		unsigned key;
+		unsigned index;
+	};
+
 	static unsigned const SIZE;
+	static unsigned const INITIAL_BITS;
 
-	std::vector<int> indices;
+	std::vector<Slot> slots;
+	unsigned bits;
+	unsigned generation;
 	std::vector<ResultsForPos> results;
 
 	public:
 
 		RaycastCache()
 		:
-			indices(SIZE * SIZE * SIZE, -1)
+			bits(INITIAL_BITS),
+			generation(1)
 		{
+			slots.resize(1 << bits);
+			clearSlots();
 		}
 
 		inline bool get(int3 pos, unsigned directionIndex, vec3 &result) const {
-			int index = indices[pos.x + SIZE * pos.y + SIZE * SIZE * pos.z];
-			if (index < 0) {
+			Slot const &slot = find(keyOf(pos));
+			if (slot.generation != generation) {
 				return false;
 			}
-			ResultsForPos const &resultsForPos = results[index];
+			ResultsForPos const &resultsForPos = results[slot.index];
 			if (!resultsForPos.has(directionIndex)) {
 				return false;
 			}
@@ -55,57 +76,133 @@ class RaycastCache {
 		}
 
 		inline void put(int3 pos, unsigned directionIndex, vec3 result) {
-			unsigned i = pos.x + SIZE * pos.y + SIZE * SIZE * pos.z;
-			int index = indices[i];
-			if (index < 0) {
-				index = results.size();
-				indices[i] = index;
+			unsigned const key = keyOf(pos);
+			Slot *slot = &find(key);
+			if (slot->generation != generation) {
+				// Keep the load factor at most one half.
+				if (2 * (results.size() + 1) > slots.size()) {
+					grow();
+					slot = &find(key);
+				}
+				slot->generation = generation;
+				slot->key = key;
+				slot->index = results.size();
 				results.push_back(ResultsForPos());
 			}
-			results[index].set(directionIndex, result);
+			results[slot->index].set(directionIndex, result);
 		}
 
-		inline void clear() {
-			std::fill(indices.begin(), indices.end(), -1);
+		void clear() {
 			results.clear();
+			++generation;
+			if (generation == 0) {
+				// Wrapped around, so old stamps could come back to life.
+				clearSlots();
+				generation = 1;
+			}
+		}
+
+		unsigned getNumEntries() const { return results.size(); }
+		unsigned getSizeInBytes() const { return slots.capacity() * sizeof(Slot) + results.capacity() * sizeof(ResultsForPos); }
+
+	private:
+
+		static inline unsigned keyOf(int3 pos) {
+			return pos.x + SIZE * (pos.y + SIZE * pos.z);
+		}
+
+		// Returns the slot holding the key, or the empty slot where it would go.
+		inline Slot const &find(unsigned key) const {
+			unsigned const mask = slots.size() - 1;
+			for (unsigned i = (key * 2654435761u) >> (32 - bits);; i = (i + 1) & mask) {
+				Slot const &slot = slots[i];
+				if (slot.generation != generation || slot.key == key) {
+					return slot;
+				}
+			}
+		}
+
+		inline Slot &find(unsigned key) {
+			return const_cast<Slot&>(static_cast<RaycastCache const*>(this)->find(key));
+		}
+
+		void clearSlots() {
+			for (std::vector<Slot>::iterator i = slots.begin(); i != slots.end(); ++i) {
+				i->generation = 0;
+			}
+		}
+
+		void grow() {
+			std::vector<Slot> oldSlots(2 * slots.size());
+			oldSlots.swap(slots);
+			++bits;
+			clearSlots();
+			for (std::vector<Slot>::const_iterator i = oldSlots.begin(); i != oldSlots.end(); ++i) {
+				if (i->generation == generation) {
+					find(i->key) = *i;
+				}
+			}
 		}
 
 };
 
 unsigned const RaycastCache::SIZE = CHUNK_SIZE + 1;
+unsigned const RaycastCache::INITIAL_BITS = 12;
 
+/* Tesselates chunks one at a time. Meant to live as long as its thread, so that the raycast directions
+ * and the big buffers are set up once, and only reset between chunks.
+ */
 class Tesselator {
 
 	std::vector<vec3> raycastDirections[8];
 	float raycastMultiplier;
-	Raycaster raycast;
+	float const raycastCutoff;
+
+	// Only valid during tesselate().
+	ChunkMap const *chunkMap;
+	Raycaster const *raycast;
 
-	ChunkMap const &chunkMap;
-	
 	int3 index;
 	ChunkGeometryPtr geometry;
 	VertexArray *vertices;
 	NormalArray *normals;
 
-	RawChunkData rawData;
-	RawChunkData rawNeighData;
 	RaycastCache raycastCache;
+	// For greedy meshing: the block of each exposed face in the current layer, or AIR_BLOCK.
+	std::vector<Block> faces;
+	// The blocks of the current neighbour's layer that touches the chunk.
+	std::vector<Block> slab;
+	// Row masks of the stone and the non-air blocks in the chunk, the non-air blocks in the current neighbour's slab,
+	// and the faces exposed in the current direction.
+	std::vector<RowMask> stone;
+	std::vector<RowMask> occupied;
+	std::vector<RowMask> neighOccupied;
+	std::vector<RowMask> exposed;
 
 	public:
 
-		Tesselator(ChunkMap const &chunkMap, float raycastCutoff = CHUNK_SIZE)
+		Tesselator(float raycastCutoff = CHUNK_SIZE)
 		:
-			raycast(chunkMap, raycastCutoff, STONE_BLOCK, BLOCK_MASK),
-			chunkMap(chunkMap)
+			raycastCutoff(raycastCutoff),
+			chunkMap(0),
+			raycast(0),
+			faces(CHUNK_SIZE * CHUNK_SIZE),
+			stone(CHUNK_SIZE * CHUNK_SIZE),
+			occupied(CHUNK_SIZE * CHUNK_SIZE),
+			neighOccupied(CHUNK_SIZE * CHUNK_SIZE),
+			exposed(CHUNK_SIZE * CHUNK_SIZE)
 		{
 			computeRaycastDirections();
 		}
 
-		void tesselate(int3 index, ChunkGeometryPtr geometry) {
+		void tesselate(ChunkMap const &chunkMap, int3 index, ChunkGeometryPtr geometry) {
 			raycastCache.clear();
 
 			TimerStat::Timed t = stats.chunkTesselationTime.timed();
 
+			Raycaster const raycaster(chunkMap, raycastCutoff, STONE_BLOCK, BLOCK_MASK);
+			this->chunkMap = &chunkMap;
+			raycast = &raycaster;
 			this->index = index;
 			this->geometry = geometry;
 			vertices = &geometry->getVertexData();
@@ -115,18 +212,38 @@ class Tesselator {
 
 			OctreeConstPtr octree = chunkMap.getOctreeOrNull(index);
 			if (octree && !octree->isEmpty()) {
-				unpackOctree(*octree, rawData);
-
-				tesselateDirection<-1,  0,  0>();
-				tesselateDirection< 1,  0,  0>();
-				tesselateDirection< 0, -1,  0>();
-				tesselateDirection< 0,  1,  0>();
-				tesselateDirection< 0,  0, -1>();
-				tesselateDirection< 0,  0,  1>();
+				// The masks are filled leaf by leaf, without unpacking the octree.
+				computeRowMasks(*octree, STONE_BLOCK, &stone[0]);
+				computeOccupancyMasks(*octree, &occupied[0]);
+
+				if (flags.greedyMeshing) {
+					tesselateDirectionGreedy<-1,  0,  0>();
+					tesselateDirectionGreedy< 1,  0,  0>();
+					tesselateDirectionGreedy< 0, -1,  0>();
+					tesselateDirectionGreedy< 0,  1,  0>();
+					tesselateDirectionGreedy< 0,  0, -1>();
+					tesselateDirectionGreedy< 0,  0,  1>();
+				} else {
+					tesselateDirection<-1,  0,  0>();
+					tesselateDirection< 1,  0,  0>();
+					tesselateDirection< 0, -1,  0>();
+					tesselateDirection< 0,  1,  0>();
+					tesselateDirection< 0,  0, -1>();
+					tesselateDirection< 0,  0,  1>();
+				}
 			}
 
 			stats.chunksTesselated.increment();
-			stats.quadsGenerated.increment(vertices->size() / 4);
+			stats.quadsGenerated.increment(geometry->getNumQuads());
+			stats.raycastCacheEntries.increment(raycastCache.getNumEntries());
+			stats.raycastCacheBytes.increment(raycastCache.getSizeInBytes());
+
+			// Don't keep the geometry alive, or point at the raycaster, past this chunk.
+			this->geometry.reset();
+			vertices = 0;
+			normals = 0;
+			raycast = 0;
+			this->chunkMap = 0;
 		}
 
 	private:
@@ -191,10 +308,10 @@ class Tesselator {
 					for (unsigned j = 0; j < raycastDirections.size(); ++j) {
 						vec3 const direction = raycastDirections[j];
 
-						RaycastResult result = raycast(index, vertex + 0.1f * direction, direction);
+						RaycastResult result = (*raycast)(index, vertex + 0.1f * direction, direction);
 						float factor = 1.0f;
 						if (result.status == RaycastResult::HIT) {
-							factor = result.length / raycast.getCutoff();
+							factor = result.length / raycast->getCutoff();
 						}
 						partialBentNormal += factor * direction;
 					}
@@ -206,8 +323,20 @@ class Tesselator {
 			return raycastMultiplier * bentNormal;
 		}
 
+		/* The axes along which the faces in a direction extend, and the one along which they face.
+		 */
+		template<int dx, int dy, int dz>
+		struct FaceAxes {
+			static unsigned const N = dx ? 0 : (dy ? 1 : 2);
+			static unsigned const U = dx ? 1 : 0;
+			static unsigned const V = dz ? 1 : 2;
+		};
+
+		/* Emits a quad covering the faces of width by height blocks, along the U and V axes,
+		 * starting at the block at x, y, z.
+		 */
 		template<int dx, int dy, int dz>
-		inline void tesselateSingleBlockFace(Block block, Block neigh, unsigned x, unsigned y, unsigned z) {
+		inline void emitQuad(unsigned x, unsigned y, unsigned z, unsigned width, unsigned height) {
 			static short const CUBE_FACES[6][12] = {
 				{ 0, 0, 0, 0, 0, 1, 0, 1, 1, 0, 1, 0 },
 				{ 1, 0, 0, 1, 1, 0, 1, 1, 1, 1, 0, 1 },
@@ -226,74 +355,225 @@ class Tesselator {
 				dx * N, dy * N, dz * N,
 			};
 
-			if (needsDrawing(block) && needsDrawing(block, neigh)) {
-				int3 const pos(x, y, z);
-				int3 m = (int3)blockMin(pos);
-				short v[12] = {
-					face[0] + m.x, face[ 1] + m.y, face[ 2] + m.z,
-					face[3] + m.x, face[ 4] + m.y, face[ 5] + m.z,
-					face[6] + m.x, face[ 7] + m.y, face[ 8] + m.z,
-					face[9] + m.x, face[10] + m.y, face[11] + m.z
-				};
-
-				unsigned writeIndex = vertices->size();
-				vertices->resize(writeIndex + 12);
-				normals->resize(writeIndex + 12);
-
-				memcpy(&(*vertices)[writeIndex], v, 12 * sizeof(short));
-				if (flags.bentNormals) {
-					for (unsigned j = 0; j < 4; ++j) {
-						int3 pos((*vertices)[writeIndex], (*vertices)[writeIndex + 1], (*vertices)[writeIndex + 2]);
-						vec3 normal = computeBentNormal<dx, dy, dz>(pos);
-						(*normals)[writeIndex++] = (int)(N * normal.x);
-						(*normals)[writeIndex++] = (int)(N * normal.y);
-						(*normals)[writeIndex++] = (int)(N * normal.z);
+			int const m[3] = { (int)x, (int)y, (int)z };
+			short v[12];
+			for (unsigned i = 0; i < 12; i += 3) {
+				for (unsigned axis = 0; axis < 3; ++axis) {
+					short corner = face[i + axis];
+					if (axis == FaceAxes<dx, dy, dz>::U) {
+						corner *= width;
+					} else if (axis == FaceAxes<dx, dy, dz>::V) {
+						corner *= height;
 					}
-				} else {
-					memcpy(&(*normals)[writeIndex], n, 12 * sizeof(char));
+					v[i + axis] = corner + m[axis];
 				}
 			}
+
+			unsigned writeIndex = vertices->size();
+			vertices->resize(writeIndex + 12);
+			normals->resize(writeIndex + 12);
+
+			memcpy(&(*vertices)[writeIndex], v, 12 * sizeof(short));
+			if (flags.bentNormals) {
+				for (unsigned j = 0; j < 4; ++j) {
+					int3 pos((*vertices)[writeIndex], (*vertices)[writeIndex + 1], (*vertices)[writeIndex + 2]);
+					int3 const normal = quantizedBentNormal<dx, dy, dz>(pos);
+					(*normals)[writeIndex++] = normal.x;
+					(*normals)[writeIndex++] = normal.y;
+					(*normals)[writeIndex++] = normal.z;
+				}
+			} else {
+				memcpy(&(*normals)[writeIndex], n, 12 * sizeof(char));
+			}
 		}
 
 		template<int dx, int dy, int dz>
-		inline void tesselateNeigh(Block const *rawData, Block const *rawNeighData);
+		inline int3 quantizedBentNormal(int3 vertex) {
+			static float const N = 0x7F;
+			vec3 const normal = computeBentNormal<dx, dy, dz>(vertex);
+			return int3((int)(N * normal.x), (int)(N * normal.y), (int)(N * normal.z));
+		}
 
+		/* Merges the exposed faces in one layer into rectangles, each emitted as a single quad.
+		 * A rectangle is grown from its first face along U as far as possible, then along V.
+		 * Faces only merge if they have the same block and, with bent normals, if all vertices they cover have the same normal.
+		 */
 		template<int dx, int dy, int dz>
-		void tesselateDirection() {
-			static int const neighOffset = dx + (int)CHUNK_SIZE * dy + (int)CHUNK_SIZE * (int)CHUNK_SIZE * dz;
+		void mergeFaces(unsigned layer) {
+			unsigned const vertexLayer = layer + (dx + dy + dz > 0 ? 1 : 0);
+			for (unsigned v = 0; v < CHUNK_SIZE; ++v) {
+				for (unsigned u = 0; u < CHUNK_SIZE; ++u) {
+					Block const block = faces[u + CHUNK_SIZE * v];
+					if (block == AIR_BLOCK) {
+						continue;
+					}
 
-			unsigned const begin = vertices->size();
+					unsigned width = 1;
+					unsigned height = 1;
+					bool const bent = flags.bentNormals;
+					int3 reference;
+					bool mergeable = true;
+					if (bent) {
+						reference = quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u, v));
+						mergeable =
+							quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u + 1, v)) == reference &&
+							quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u, v + 1)) == reference &&
+							quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u + 1, v + 1)) == reference;
+					}
+					if (mergeable) {
+						while (u + width < CHUNK_SIZE && faces[u + width + CHUNK_SIZE * v] == block &&
+								(!bent || (
+									quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u + width + 1, v)) == reference &&
+									quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, u + width + 1, v + 1)) == reference))) {
+							++width;
+						}
+						for (; v + height < CHUNK_SIZE; ++height) {
+							bool rowMatches = true;
+							for (unsigned i = u; i < u + width && rowMatches; ++i) {
+								rowMatches = faces[i + CHUNK_SIZE * (v + height)] == block;
+							}
+							for (unsigned i = u; i <= u + width && rowMatches && bent; ++i) {
+								rowMatches = quantizedBentNormal<dx, dy, dz>(facePosition<dx, dy, dz>(vertexLayer, i, v + height + 1)) == reference;
+							}
+							if (!rowMatches) {
+								break;
+							}
+						}
+					}
 
-			unsigned const xMin = (dx == -1 ? 1 : 0);
-			unsigned const yMin = (dy == -1 ? 1 : 0);
-			unsigned const zMin = (dz == -1 ? 1 : 0);
-			unsigned const xMax = CHUNK_SIZE - (dx == 1 ? 1 : 0);
-			unsigned const yMax = CHUNK_SIZE - (dy == 1 ? 1 : 0);
-			unsigned const zMax = CHUNK_SIZE - (dz == 1 ? 1 : 0);
-			Block const *raw = rawData.raw();
-			Block const *p = raw +
-				xMin +
-				yMin * CHUNK_SIZE +
-				zMin * CHUNK_SIZE * CHUNK_SIZE;
-			for (unsigned z = zMin; z < zMax; ++z) {
-				for (unsigned y = yMin; y < yMax; ++y) {
-					for (unsigned x = xMin; x < xMax; ++x) {
-						tesselateSingleBlockFace<dx, dy, dz>(*p, p[neighOffset], x, y, z);
-						++p;
+					for (unsigned j = v; j < v + height; ++j) {
+						std::fill(&faces[u + CHUNK_SIZE * j], &faces[u + width + CHUNK_SIZE * j], (Block)AIR_BLOCK);
 					}
-					if (dx != 0) {
-						++p;
+					int3 const pos = facePosition<dx, dy, dz>(layer, u, v);
+					emitQuad<dx, dy, dz>(pos.x, pos.y, pos.z, width, height);
+				}
+			}
+		}
+
+		template<int dx, int dy, int dz>
+		static inline int3 facePosition(unsigned layer, unsigned u, unsigned v) {
+			typedef FaceAxes<dx, dy, dz> Axes;
+			int c[3];
+			c[Axes::N] = layer;
+			c[Axes::U] = u;
+			c[Axes::V] = v;
+			return int3(c[0], c[1], c[2]);
+		}
+
+		/* Greedy meshing: collects the exposed faces of each layer, then merges them into rectangles.
+		 */
+		template<int dx, int dy, int dz>
+		void tesselateDirectionGreedy() {
+			unsigned const begin = vertices->size();
+
+			findExposedFaces<dx, dy, dz>();
+
+			for (unsigned layer = 0; layer < CHUNK_SIZE; ++layer) {
+				bool any = false;
+				for (unsigned v = 0; v < CHUNK_SIZE; ++v) {
+					if (dx) {
+						for (unsigned u = 0; u < CHUNK_SIZE; ++u) {
+							if (exposed[u + CHUNK_SIZE * v].test(layer)) {
+								faces[u + CHUNK_SIZE * v] = STONE_BLOCK;
+								any = true;
+							}
+						}
+					} else {
+						RowMask const &row = dy ? exposed[layer + CHUNK_SIZE * v] : exposed[v + CHUNK_SIZE * layer];
+						for (unsigned w = 0; w < 2; ++w) {
+							for (uint64_t bits = row.words[w]; bits; bits &= bits - 1) {
+								faces[64 * w + __builtin_ctzll(bits) + CHUNK_SIZE * v] = STONE_BLOCK;
+								any = true;
+							}
+						}
 					}
 				}
-				if (dy != 0) {
-					p += CHUNK_SIZE;
+				// Merging consumes all faces, leaving the layer clear for the next one.
+				if (any) {
+					mergeFaces<dx, dy, dz>(layer);
 				}
 			}
 
-			OctreeConstPtr neighOctree = chunkMap.getOctreeOrNull(index + int3(dx, dy, dz));
+			unsigned const end = vertices->size();
+			geometry->setRange(FaceIndex<dx, dy, dz>::value, Range(begin, end));
+		}
+
+		/* Fetches the layer of the neighbour in the given direction that touches the chunk,
+		 * and turns it into the rows the kernels read beyond the chunk boundary:
+		 * for x, the boundary bit of each of the chunk's rows; for y and z, one row for each v of the slab.
+		 */
+		template<int dx, int dy, int dz>
+		void loadNeighbourSlab() {
+			OctreeConstPtr neighOctree = chunkMap->getOctreeOrNull(index + int3(dx, dy, dz));
 			BOOST_ASSERT(neighOctree);
-			unpackOctree(*neighOctree, rawNeighData);
-			tesselateNeigh<dx, dy, dz>(raw, rawNeighData.raw());
+			extractOctreeSlab(*neighOctree, FaceAxes<dx, dy, dz>::N, dx + dy + dz > 0 ? 0 : CHUNK_SIZE - 1, slab);
+
+			unsigned const boundaryBit = dx > 0 ? 0 : CHUNK_SIZE - 1;
+			std::fill(neighOccupied.begin(), neighOccupied.begin() + (dx ? CHUNK_SIZE * CHUNK_SIZE : CHUNK_SIZE), RowMask());
+			for (unsigned v = 0; v < CHUNK_SIZE; ++v) {
+				for (unsigned u = 0; u < CHUNK_SIZE; ++u) {
+					if (slab[u + CHUNK_SIZE * v] == AIR_BLOCK) {
+						continue;
+					}
+					if (dx) {
+						neighOccupied[u + CHUNK_SIZE * v].set(boundaryBit);
+					} else {
+						neighOccupied[v].set(u);
+					}
+				}
+			}
+		}
+
+		/* Fills the exposed row masks with the faces in the given direction that need drawing:
+		 * stone blocks with air in front of them, as in needsDrawing(Block, Block).
+		 * The rows on the chunk boundary look into the neighbouring chunk's slab.
+		 */
+		template<int dx, int dy, int dz>
+		void findExposedFaces() {
+			loadNeighbourSlab<dx, dy, dz>();
+
+			unsigned const numRows = CHUNK_SIZE * CHUNK_SIZE;
+			RowMask const *s = &stone[0];
+			RowMask const *o = &occupied[0];
+			RowMask const *n = &neighOccupied[0];
+			RowMask *e = &exposed[0];
+			if (dx > 0) {
+				andNotRowsNextX(s, o, n, e, numRows);
+			} else if (dx < 0) {
+				andNotRowsPrevX(s, o, n, e, numRows);
+			} else if (dy > 0) {
+				for (unsigned r = 0; r < numRows; r += CHUNK_SIZE) {
+					andNotRows(s + r, o + r + 1, e + r, CHUNK_SIZE - 1);
+					andNotRows(s + r + CHUNK_SIZE - 1, n + r / CHUNK_SIZE, e + r + CHUNK_SIZE - 1, 1);
+				}
+			} else if (dy < 0) {
+				for (unsigned r = 0; r < numRows; r += CHUNK_SIZE) {
+					andNotRows(s + r + 1, o + r, e + r + 1, CHUNK_SIZE - 1);
+					andNotRows(s + r, n + r / CHUNK_SIZE, e + r, 1);
+				}
+			} else if (dz > 0) {
+				andNotRows(s, o + CHUNK_SIZE, e, numRows - CHUNK_SIZE);
+				andNotRows(s + numRows - CHUNK_SIZE, n, e + numRows - CHUNK_SIZE, CHUNK_SIZE);
+			} else {
+				andNotRows(s + CHUNK_SIZE, o, e + CHUNK_SIZE, numRows - CHUNK_SIZE);
+				andNotRows(s, n, e, CHUNK_SIZE);
+			}
+		}
+
+		/* Emits a quad for each exposed face. Only the set bits are visited.
+		 */
+		template<int dx, int dy, int dz>
+		void tesselateDirection() {
+			unsigned const begin = vertices->size();
+
+			findExposedFaces<dx, dy, dz>();
+			for (unsigned r = 0; r < CHUNK_SIZE * CHUNK_SIZE; ++r) {
+				for (unsigned w = 0; w < 2; ++w) {
+					for (uint64_t bits = exposed[r].words[w]; bits; bits &= bits - 1) {
+						emitQuad<dx, dy, dz>(64 * w + __builtin_ctzll(bits), r % CHUNK_SIZE, r / CHUNK_SIZE, 1, 1);
+					}
+				}
+			}
 
 			unsigned const end = vertices->size();
 			geometry->setRange(FaceIndex<dx, dy, dz>::value, Range(begin, end));
@@ -309,83 +589,10 @@ template<> int Tesselator::FaceIndex< 0,  1,  0>::value = 3;
 template<> int Tesselator::FaceIndex< 0,  0, -1>::value = 4;
 template<> int Tesselator::FaceIndex< 0,  0,  1>::value = 5;
 
-template<>
-inline void Tesselator::tesselateNeigh<-1, 0, 0>(Block const *p, Block const *q) {
-	q += CHUNK_SIZE - 1;
-	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
-		for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
-			tesselateSingleBlockFace<-1, 0, 0>(*p, *q, (unsigned)0, y, z);
-			p += CHUNK_SIZE;
-			q += CHUNK_SIZE;
-		}
-	}
-}
-
-template<>
-inline void Tesselator::tesselateNeigh<1, 0, 0>(Block const *p, Block const *q) {
-	p += CHUNK_SIZE - 1;
-	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
-		for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
-			tesselateSingleBlockFace<1, 0, 0>(*p, *q, CHUNK_SIZE - 1, y, z);
-			p += CHUNK_SIZE;
-			q += CHUNK_SIZE;
-		}
-	}
-}
-
-template<>
-inline void Tesselator::tesselateNeigh<0, -1, 0>(Block const *p, Block const *q) {
-	q += CHUNK_SIZE * (CHUNK_SIZE - 1);
-	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
-		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-			tesselateSingleBlockFace<0, -1, 0>(*p, *q, x, (unsigned)0, z);
-			++p;
-			++q;
-		}
-		p += CHUNK_SIZE * (CHUNK_SIZE - 1);
-		q += CHUNK_SIZE * (CHUNK_SIZE - 1);
-	}
-}
-
-template<>
-inline void Tesselator::tesselateNeigh<0, 1, 0>(Block const *p, Block const *q) {
-	p += CHUNK_SIZE * (CHUNK_SIZE - 1);
-	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
-		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-			tesselateSingleBlockFace<0, 1, 0>(*p, *q, x, CHUNK_SIZE - 1, z);
-			++p;
-			++q;
-		}
-		p += CHUNK_SIZE * (CHUNK_SIZE - 1);
-		q += CHUNK_SIZE * (CHUNK_SIZE - 1);
-	}
-}
-
-template<>
-inline void Tesselator::tesselateNeigh<0, 0, -1>(Block const *p, Block const *q) {
-	q += CHUNK_SIZE * CHUNK_SIZE * (CHUNK_SIZE - 1);
-	for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
-		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-			tesselateSingleBlockFace<0, 0, -1>(*p, *q, x, y, (unsigned)0);
-			++p;
-			++q;
-		}
-	}
-}
-
-template<>
-inline void Tesselator::tesselateNeigh<0, 0, 1>(Block const *p, Block const *q) {
-	p += CHUNK_SIZE * CHUNK_SIZE * (CHUNK_SIZE - 1);
-	for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
-		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-			tesselateSingleBlockFace<0, 0, 1>(*p, *q, x, y, CHUNK_SIZE - 1);
-			++p;
-			++q;
-		}
-	}
+namespace {
+	PerThread<Tesselator> tesselators;
 }
 
 void tesselate(int3 index, ChunkMap const &chunkMap, ChunkGeometryPtr geometry) {
-	Tesselator tesselator(chunkMap);
-	tesselator.tesselate(index, geometry);
+	tesselators.get().tesselate(chunkMap, index, geometry);
 }
@@ -42,6 +42,7 @@ class ChunkGeometry {
 		unsigned getNumQuads() const { return vertexData.size() / (3 * 4); };
 
 		bool isEmpty() const { return vertexData.size() == 0; }
+		unsigned getSizeInBytes() const { return vertexData.capacity() * sizeof(short) + normalData.capacity() * sizeof(char); }
 
 };
 
@@ -0,0 +1,234 @@
+#include "geometry.h"
+
+#include "chunkdata.h"
+#include "chunkmap.h"
+#include "flags.h"
+#include "octree.h"
+#include "stats.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+	struct Fixture {
+		ChunkMap chunkMap;
+
+		Fixture() {
+			// Raycasting for bent normals is slow, and not what is tested here.
+			flags.bentNormals = false;
+			flags.greedyMeshing = false;
+			// Stone below the center chunk, air around and above it.
+			for (int z = -1; z <= 1; ++z) {
+				for (int y = -1; y <= 1; ++y) {
+					for (int x = -1; x <= 1; ++x) {
+						OctreePtr octree(new Octree());
+						buildUniformOctree(z < 0 ? STONE_BLOCK : AIR_BLOCK, *octree);
+						chunkMap[int3(x, y, z)]->setOctree(octree);
+					}
+				}
+			}
+		}
+
+		~Fixture() {
+			setDefaultFlags();
+		}
+
+		void setChunk(int3 index, RawChunkData const &data) {
+			OctreePtr octree(new Octree());
+			buildOctree(data, *octree);
+			chunkMap[index]->setOctree(octree);
+		}
+
+		void setCenter(RawChunkData const &data) {
+			setChunk(int3(0, 0, 0), data);
+		}
+
+		ChunkGeometryPtr tesselateCenter(bool greedy) {
+			flags.greedyMeshing = greedy;
+			ChunkGeometryPtr geometry(new ChunkGeometry());
+			tesselate(int3(0, 0, 0), chunkMap, geometry);
+			return geometry;
+		}
+
+		// Returns the number of block faces covered by the quads of the given face direction.
+		unsigned area(ChunkGeometryPtr geometry, unsigned faceIndex) {
+			VertexArray const &vertices = geometry->getVertexData();
+			Range const range = geometry->getRanges()[faceIndex];
+			unsigned total = 0;
+			for (unsigned i = range.begin; i < range.end; i += 12) {
+				unsigned size = 1;
+				for (unsigned axis = 0; axis < 3; ++axis) {
+					short const a = std::min(std::min(vertices[i + axis], vertices[i + 3 + axis]), std::min(vertices[i + 6 + axis], vertices[i + 9 + axis]));
+					short const b = std::max(std::max(vertices[i + axis], vertices[i + 3 + axis]), std::max(vertices[i + 6 + axis], vertices[i + 9 + axis]));
+					if (b > a) {
+						size *= b - a;
+					}
+				}
+				total += size;
+			}
+			return total;
+		}
+
+		// Counts the faces that need drawing block by block, looking into the neighbouring octrees at the boundary.
+		unsigned expectedArea(RawChunkData const &data, unsigned faceIndex) {
+			static int const DIRECTIONS[6][3] = {
+				{ -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 }
+			};
+			int3 const direction(DIRECTIONS[faceIndex][0], DIRECTIONS[faceIndex][1], DIRECTIONS[faceIndex][2]);
+			int const size = CHUNK_SIZE;
+			unsigned total = 0;
+			for (int z = 0; z < size; ++z) {
+				for (int y = 0; y < size; ++y) {
+					for (int x = 0; x < size; ++x) {
+						int3 const pos(x, y, z);
+						int3 const neighPos = pos + direction;
+						Block neigh;
+						bool const outside =
+							neighPos.x < 0 || neighPos.y < 0 || neighPos.z < 0 ||
+							neighPos.x >= size || neighPos.y >= size || neighPos.z >= size;
+						if (outside) {
+							int3 const chunkOffset = chunkIndexFromPosition(neighPos);
+							int3 base;
+							unsigned blockSize;
+							chunkMap.getOctreeOrNull(chunkOffset)->getBlock(neighPos - chunkPositionFromIndex(chunkOffset), &neigh, &base, &blockSize);
+						} else {
+							neigh = data[neighPos];
+						}
+						if (needsDrawing(data[pos]) && needsDrawing(data[pos], neigh)) {
+							++total;
+						}
+					}
+				}
+			}
+			return total;
+		}
+
+		void testSameArea(RawChunkData const &data) {
+			ChunkGeometryPtr single = tesselateCenter(false);
+			ChunkGeometryPtr greedy = tesselateCenter(true);
+			for (unsigned faceIndex = 0; faceIndex < 6; ++faceIndex) {
+				Range const range = single->getRanges()[faceIndex];
+				BOOST_REQUIRE_EQUAL(expectedArea(data, faceIndex), area(single, faceIndex));
+				BOOST_REQUIRE_EQUAL((range.end - range.begin) / 12, area(single, faceIndex));
+				BOOST_REQUIRE_EQUAL(area(single, faceIndex), area(greedy, faceIndex));
+			}
+			BOOST_REQUIRE_EQUAL(single->getVertexData().size(), single->getNormalData().size());
+			BOOST_REQUIRE_EQUAL(greedy->getVertexData().size(), greedy->getNormalData().size());
+			BOOST_REQUIRE_LE(greedy->getNumQuads(), single->getNumQuads());
+		}
+	};
+}
+
+BOOST_FIXTURE_TEST_SUITE(GeometryTest, Fixture)
+
+BOOST_AUTO_TEST_CASE(TestGreedyFlatFloor) {
+	RawChunkData data;
+	for (int z = 0; z < 64; ++z) {
+		for (int y = 0; y < (int)CHUNK_SIZE; ++y) {
+			for (int x = 0; x < (int)CHUNK_SIZE; ++x) {
+				data[int3(x, y, z)] = STONE_BLOCK;
+			}
+		}
+	}
+	setCenter(data);
+	testSameArea(data);
+
+	ChunkGeometryPtr greedy = tesselateCenter(true);
+	// One quad on top, and one for each of the four sides facing air.
+	BOOST_REQUIRE_EQUAL(5u, greedy->getNumQuads());
+}
+
+BOOST_AUTO_TEST_CASE(TestGreedyPitsAndPillars) {
+	RawChunkData data;
+	srand(0);
+	for (int z = 0; z < 64; ++z) {
+		for (int y = 0; y < (int)CHUNK_SIZE; ++y) {
+			for (int x = 0; x < (int)CHUNK_SIZE; ++x) {
+				data[int3(x, y, z)] = STONE_BLOCK;
+			}
+		}
+	}
+	for (unsigned i = 0; i < 50; ++i) {
+		int3 const min(rand() % CHUNK_SIZE, rand() % CHUNK_SIZE, 32 + rand() % 64);
+		int3 const max = glm::min(min + int3(1 + rand() % 16, 1 + rand() % 16, 1 + rand() % 16), int3(CHUNK_SIZE));
+		Block const block = rand() % 2 ? STONE_BLOCK : AIR_BLOCK;
+		for (int z = min.z; z < max.z; ++z) {
+			for (int y = min.y; y < max.y; ++y) {
+				for (int x = min.x; x < max.x; ++x) {
+					data[int3(x, y, z)] = block;
+				}
+			}
+		}
+	}
+	setCenter(data);
+	testSameArea(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestGreedyRandom) {
+	RawChunkData data;
+	srand(0);
+	for (RawChunkData::iterator i = data.begin(); i != data.end(); ++i) {
+		*i = rand() % 2 ? STONE_BLOCK : AIR_BLOCK;
+	}
+	setCenter(data);
+	testSameArea(data);
+}
+
+namespace {
+	void fillBox(RawChunkData &data, int3 min, int3 max) {
+		for (int z = min.z; z < max.z; ++z) {
+			for (int y = min.y; y < max.y; ++y) {
+				for (int x = min.x; x < max.x; ++x) {
+					data[int3(x, y, z)] = STONE_BLOCK;
+				}
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestBentNormalsAfterClear) {
+	flags.bentNormals = true;
+	RawChunkData cube;
+	fillBox(cube, int3(10, 10, 10), int3(13, 13, 13));
+	// A wall next to the cube, which shades the vertices they share.
+	RawChunkData cubeAndWall;
+	fillBox(cubeAndWall, int3(10, 10, 10), int3(13, 13, 13));
+	fillBox(cubeAndWall, int3(13, 6, 6), int3(15, 17, 17));
+
+	setCenter(cube);
+	unsigned const hits = stats.raycastCacheHits.get();
+	ChunkGeometryPtr before = tesselateCenter(false);
+	// Each corner of the cube is shared by three faces.
+	BOOST_REQUIRE_GT(stats.raycastCacheHits.get(), hits);
+
+	setCenter(cubeAndWall);
+	tesselateCenter(false);
+
+	// Nothing computed for the previous chunk may be reused.
+	setCenter(cube);
+	ChunkGeometryPtr after = tesselateCenter(false);
+	BOOST_REQUIRE(before->getVertexData() == after->getVertexData());
+	BOOST_REQUIRE(before->getNormalData() == after->getNormalData());
+}
+
+BOOST_AUTO_TEST_CASE(TestRandomNeighbours) {
+	RawChunkData data;
+	srand(0);
+	for (unsigned n = 0; n < 6; ++n) {
+		int const d = n % 2 ? 1 : -1;
+		int3 const index(n / 2 == 0 ? d : 0, n / 2 == 1 ? d : 0, n / 2 == 2 ? d : 0);
+		for (RawChunkData::iterator i = data.begin(); i != data.end(); ++i) {
+			*i = rand() % 2 ? STONE_BLOCK : AIR_BLOCK;
+		}
+		setChunk(index, data);
+	}
+	for (RawChunkData::iterator i = data.begin(); i != data.end(); ++i) {
+		*i = rand() % 2 ? STONE_BLOCK : AIR_BLOCK;
+	}
+	setCenter(data);
+	testSameArea(data);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
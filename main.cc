@@ -4,6 +4,7 @@
 #include "raycaster.h"
 #include "stats.h"
 #include "terragen.h"
+#include "trace.h"
 #include "world.h"
 
 #include <GLFW/glfw3.h>
@@ -216,6 +217,7 @@ void run() {
 		clock_gettime(CLOCK_MONOTONIC, &lastUpdate);
 		while (running && !glfwWindowShouldClose(window)) {
 			TimerStat::Timed t = stats.runningTime.timed();
+			TraceSpan span("frame");
 
 			float dt;
 			if (flags.fixedTimestep) {
@@ -254,6 +256,9 @@ int main(int argc, char **argv) {
 		printHelp();
 		return EXIT_SUCCESS;
 	}
+	if (!flags.traceFile.empty()) {
+		startTracing();
+	}
 
   glfwSetErrorCallback(errorCallback);
 
@@ -322,6 +327,9 @@ int main(int argc, char **argv) {
 	run();
 
 	stats.print();
+	if (isTracing() && !writeTrace(flags.traceFile.c_str())) {
+		std::cerr << "Could not write trace to " << flags.traceFile << '\n';
+	}
 	glfwTerminate();
 
 	return EXIT_SUCCESS;
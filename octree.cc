@@ -2,14 +2,34 @@
 
 #include "chunkdata.h"
 #include "stats.h"
+#include "threading.h"
+
+#include <algorithm>
+
+void Octree::setExternalNodes(OctreeNode const *nodes, unsigned numNodes, boost::shared_ptr<void const> owner) {
+	BOOST_ASSERT(nodes || numNodes == 0);
+	OctreeNodes().swap(this->nodes);
+	// An empty octree needs no external memory.
+	externalNodes = numNodes ? nodes : 0;
+	numExternalNodes = numNodes;
+	externalOwner = numNodes ? owner : boost::shared_ptr<void const>();
+}
+
+void Octree::shrinkToFit() {
+	BOOST_ASSERT(!externalNodes);
+	// Builders grow the nodes as they go, but the octree may stay in memory for a long time,
+	// so the excess capacity is given back once it is complete.
+	OctreeNodes(nodes).swap(nodes);
+}
 
 void Octree::getBlock(int3 position, Block *block, int3 *base, unsigned *size) const {
 	*base = int3(0, 0, 0);
 	*size = CHUNK_SIZE;
-	if (nodes.size() == 0) {
+	if (isEmpty()) {
 		*block = AIR_BLOCK;
 		return;
 	}
+	OctreeNode const *nodes = getNodeData();
 	unsigned nodeIndex = 0;
 	for (int mask = CHUNK_SIZE >> 1;; mask >>= 1) {
 		OctreeNode const &node = nodes[nodeIndex];
@@ -22,7 +42,7 @@ void Octree::getBlock(int3 position, Block *block, int3 *base, unsigned *size) c
 			((position.x & mask) ? 1 : 0) |
 			((position.y & mask) ? 2 : 0) |
 			((position.z & mask) ? 4 : 0);
-		nodeIndex = node.children[childIndexInParent];
+		nodeIndex = node.getChild(childIndexInParent);
 		*size >>= 1;
 		*base += int3(
 				(position.x & mask) ? *size : 0,
@@ -35,74 +55,332 @@ void Octree::getBlock(int3 position, Block *block, int3 *base, unsigned *size) c
 	}
 }
 
-inline Block determineType(unsigned size, Block const *base) {
-	Block const block = *base;
+/* The builder and unpacker work on both RawChunkData and PackedChunkData,
+ * through their get, fill and isUniformRun members, using linear block indices.
+ */
+template<typename ChunkData>
+inline Block determineType(unsigned size, unsigned base, ChunkData const &data) {
 	for (unsigned z = 0; z < size; ++z) {
 		for (unsigned y = 0; y < size; ++y) {
-			for (unsigned x = 0; x < size; ++x) {
-				Block const b = *base;
-				if (b != block) {
-					return INVALID_BLOCK;
-				}
-				++base;
+			if (!data.isUniformRun(base + CHUNK_SIZE * CHUNK_SIZE * z + CHUNK_SIZE * y, size, base)) {
+				return INVALID_BLOCK;
 			}
-			base += CHUNK_SIZE - size;
 		}
-		base += CHUNK_SIZE * (CHUNK_SIZE - size);
 	}
-	return block;
+	return data.get(base);
 }
 
-unsigned subdivideOctree(unsigned size, Block const *base, OctreeNodes &nodes) {
-	if (size == 1) {
-		if (*base == AIR_BLOCK) {
-			return 0; // AIR_BLOCK is implicit
-		} else {
-			nodes.push_back(OctreeNode(*base));
-			return nodes.size() - 1;
+template<typename ChunkData>
+void subdivideOctree(unsigned size, unsigned base, unsigned nodeIndex, OctreeNodes &nodes, ChunkData const &data) {
+	// The node is known to be mixed; find out what its children are,
+	// then allocate the ones that are not air next to each other.
+	unsigned const s = size / 2;
+	unsigned const sx = s;
+	unsigned const sy = CHUNK_SIZE * s;
+	unsigned const sz = CHUNK_SIZE * CHUNK_SIZE * s;
+	unsigned const childBases[8] = {
+		base               ,
+		base +           sx,
+		base +      sy     ,
+		base +      sy + sx,
+		base + sz          ,
+		base + sz +      sx,
+		base + sz + sy     ,
+		base + sz + sy + sx
+	};
+	Block childBlocks[8];
+	unsigned childMask = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		childBlocks[i] = s == 1 ? data.get(childBases[i]) : determineType(s, childBases[i], data);
+		if (childBlocks[i] != AIR_BLOCK) {
+			childMask |= 1 << i;
 		}
-	} else {
-		Block const block = determineType(size, base);
-		if (block == AIR_BLOCK) {
-			return 0;
-		} else {
-			unsigned const i = nodes.size();
-			// Don't operate on the new node directly,
-			// since the vector might reallocate in the meantime.
-			nodes.push_back(OctreeNode());
-			OctreeNode node(block);
-			if (block == INVALID_BLOCK) {
-				unsigned const s = size / 2;
-				unsigned const sx = s;
-				unsigned const sy = CHUNK_SIZE * s;
-				unsigned const sz = CHUNK_SIZE * CHUNK_SIZE * s;
-				node.children[0] = subdivideOctree(s, base               , nodes);
-				node.children[1] = subdivideOctree(s, base +           sx, nodes);
-				node.children[2] = subdivideOctree(s, base +      sy     , nodes);
-				node.children[3] = subdivideOctree(s, base +      sy + sx, nodes);
-				node.children[4] = subdivideOctree(s, base + sz          , nodes);
-				node.children[5] = subdivideOctree(s, base + sz +      sx, nodes);
-				node.children[6] = subdivideOctree(s, base + sz + sy     , nodes);
-				node.children[7] = subdivideOctree(s, base + sz + sy + sx, nodes);
+	}
+
+	unsigned const firstChild = nodes.size();
+	nodes[nodeIndex].setChildren(firstChild, childMask);
+	for (unsigned i = 0; i < 8; ++i) {
+		if (childMask & (1 << i)) {
+			nodes.push_back(OctreeNode(childBlocks[i]));
+		}
+	}
+	unsigned child = firstChild;
+	for (unsigned i = 0; i < 8; ++i) {
+		if (childMask & (1 << i)) {
+			if (childBlocks[i] == INVALID_BLOCK) {
+				subdivideOctree(s, childBases[i], child, nodes, data);
 			}
-			nodes[i] = node;
-			return i;
+			++child;
 		}
 	}
 }
 
-void buildOctree(RawChunkData const &rawChunkData, Octree &octree) {
+template<typename ChunkData>
+void buildOctreeTopDownFrom(ChunkData const &data, Octree &octree) {
 	TimerStat::Timed timed = stats.octreeBuildTime.timed();
 	octree = Octree();
-	Block const *raw = rawChunkData.raw();
-	subdivideOctree(CHUNK_SIZE, raw, octree.getNodes());
+	OctreeNodes &nodes = octree.getNodes();
+	Block const block = determineType(CHUNK_SIZE, 0, data);
+	if (block != AIR_BLOCK) {
+		nodes.push_back(OctreeNode(block));
+		if (block == INVALID_BLOCK) {
+			subdivideOctree(CHUNK_SIZE, 0, 0, nodes, data);
+		}
+	}
+	octree.shrinkToFit();
 	stats.octreesBuilt.increment();
-	stats.octreeNodes.increment(octree.getNodes().size());
+	stats.octreeNodes.increment(octree.getNumNodes());
+	stats.octreeBytes.increment(octree.getSizeInBytes());
+}
+
+void buildOctreeTopDown(RawChunkData const &rawChunkData, Octree &octree) {
+	buildOctreeTopDownFrom(rawChunkData, octree);
+}
+
+void buildOctreeTopDown(PackedChunkData const &packedChunkData, Octree &octree) {
+	buildOctreeTopDownFrom(packedChunkData, octree);
+}
+
+OctreeNode mergeChildren(unsigned firstChild, OctreeNodes &nodes) {
+	Block const first = nodes[firstChild].block;
+	bool uniform = first != INVALID_BLOCK;
+	for (unsigned i = 1; i < 8 && uniform; ++i) {
+		uniform = nodes[firstChild + i].block == first;
+	}
+	if (uniform) {
+		// Leaves have no subtrees, so the slots are the last nodes.
+		nodes.resize(firstChild);
+		return OctreeNode(first);
+	}
+
+	unsigned childMask = 0;
+	unsigned numChildren = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		if (nodes[firstChild + i].block != AIR_BLOCK) {
+			childMask |= 1 << i;
+			nodes[firstChild + numChildren] = nodes[firstChild + i];
+			++numChildren;
+		}
+	}
+	unsigned const removed = 8 - numChildren;
+	if (removed) {
+		// Close the gap, and shift the subtrees' child indices down with them.
+		nodes.erase(nodes.begin() + firstChild + numChildren, nodes.begin() + firstChild + 8);
+		for (unsigned i = firstChild; i < nodes.size(); ++i) {
+			OctreeNode &node = nodes[i];
+			if (node.block == INVALID_BLOCK) {
+				node.setChildren(node.getFirstChild() - removed, node.getChildMask());
+			}
+		}
+	}
+
+	OctreeNode node;
+	node.setChildren(firstChild, childMask);
+	return node;
 }
 
-void unpackOctreeNodes(unsigned size, unsigned index, OctreeNodes const &nodes, Block *base) {
+bool isValidOctree(OctreeNode const *nodes, unsigned numNodes) {
+	for (unsigned i = 0; i < numNodes; ++i) {
+		OctreeNode const &node = nodes[i];
+		if (node.block != INVALID_BLOCK) {
+			continue;
+		}
+		unsigned const childMask = node.getChildMask();
+		// Children after their parent also rule out cycles, so walks are bounded by the depth of the chunk.
+		if (childMask == 0 || node.getFirstChild() <= i ||
+				(uint64_t)node.getFirstChild() + __builtin_popcount(childMask) > numNodes) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Scratch space for building octrees bottom-up.
+ * Level l, for 1 <= l <= CHUNK_POWER, holds for each aligned cube of size 2^l its block if it is uniform,
+ * or INVALID_BLOCK if it is mixed, in z, y, x order. Level 0 would be the blocks themselves.
+ */
+class OctreeLevels {
+
+	std::vector<std::vector<Block> > levels;
+
+	public:
+
+		OctreeLevels()
+		:
+			levels(CHUNK_POWER + 1)
+		{
+			for (unsigned level = 1; level <= CHUNK_POWER; ++level) {
+				unsigned const side = CHUNK_SIZE >> level;
+				levels[level].resize(side * side * side);
+			}
+		}
+
+		// Merges each 2x2x2 group of cells one level down.
+		template<typename ChunkData>
+		void build(ChunkData const &data) {
+			mergeLevel(CHUNK_SIZE, data, levels[1]);
+			for (unsigned level = 2; level <= CHUNK_POWER; ++level) {
+				mergeLevel(CHUNK_SIZE >> (level - 1), LevelData(levels[level - 1]), levels[level]);
+			}
+		}
+
+		template<typename ChunkData>
+		Block get(unsigned level, unsigned x, unsigned y, unsigned z, ChunkData const &data) const {
+			unsigned const side = CHUNK_SIZE >> level;
+			unsigned const index = x + side * (y + side * z);
+			return level == 0 ? data.get(index) : levels[level][index];
+		}
+
+	private:
+
+		struct LevelData {
+			std::vector<Block> const &blocks;
+			LevelData(std::vector<Block> const &blocks) : blocks(blocks) { }
+			Block get(unsigned index) const { return blocks[index]; }
+		};
+
+		/* Handles a word of each of the four rows at once.
+		 * A field is a block's code; a pair of fields is uniform if it is equal to the pair in the other rows,
+		 * and its first field equals its second.
+		 */
+		static void mergeLevel(unsigned side, PackedChunkData const &data, std::vector<Block> &out) {
+			std::vector<Block> const &palette = data.getPalette();
+			unsigned const bits = data.getBitsPerBlock();
+			unsigned const blocksPerWord = data.getBlocksPerWord();
+			uint32_t const codeMask = (uint32_t)(((uint64_t)1 << bits) - 1);
+			uint32_t const pairMask = codeMask | (codeMask << bits);
+			uint32_t firstFields = codeMask;
+			for (unsigned shift = 2 * bits; shift < 32; shift *= 2) {
+				firstFields |= firstFields << shift;
+			}
+
+			unsigned const dy = side;
+			unsigned const dz = side * side;
+			unsigned i = 0;
+			for (unsigned z = 0; z < side; z += 2) {
+				for (unsigned y = 0; y < side; y += 2) {
+					unsigned const row = y * dy + z * dz;
+					for (unsigned x = 0; x < side; x += blocksPerWord) {
+						unsigned const p = row + x;
+						uint32_t const r0 = data.getWord(p);
+						uint32_t const diff =
+							(r0 ^ data.getWord(p + dy)) |
+							(r0 ^ data.getWord(p + dz)) |
+							(r0 ^ data.getWord(p + dz + dy)) |
+							((r0 ^ (r0 >> bits)) & firstFields);
+						for (unsigned shift = 0; shift < 32; shift += 2 * bits) {
+							out[i] = ((diff >> shift) & pairMask) ? INVALID_BLOCK : palette[(r0 >> shift) & codeMask];
+							++i;
+						}
+					}
+				}
+			}
+		}
+
+		template<typename ChunkData>
+		static void mergeLevel(unsigned side, ChunkData const &data, std::vector<Block> &out) {
+			// Walks the lower level in order, reading the 2x2x2 groups a pair of rows at a time.
+			unsigned const dy = side;
+			unsigned const dz = side * side;
+			unsigned i = 0;
+			for (unsigned z = 0; z < side; z += 2) {
+				for (unsigned y = 0; y < side; y += 2) {
+					unsigned p = y * dy + z * dz;
+					for (unsigned x = 0; x < side; x += 2) {
+						Block const block = data.get(p);
+						bool const uniform =
+							data.get(p + 1) == block &&
+							data.get(p + dy) == block &&
+							data.get(p + dy + 1) == block &&
+							data.get(p + dz) == block &&
+							data.get(p + dz + 1) == block &&
+							data.get(p + dz + dy) == block &&
+							data.get(p + dz + dy + 1) == block;
+						out[i] = uniform ? block : INVALID_BLOCK;
+						++i;
+						p += 2;
+					}
+				}
+			}
+		}
+
+};
+
+namespace {
+	PerThread<OctreeLevels> octreeLevelsScratch;
+}
+
+template<typename ChunkData>
+void emitChildren(OctreeLevels const &levels, unsigned level, unsigned x, unsigned y, unsigned z, unsigned nodeIndex, OctreeNodes &nodes, ChunkData const &data) {
+	// Same layout as subdivideOctree, but the children's types are simply looked up.
+	unsigned const childLevel = level - 1;
+	Block childBlocks[8];
+	unsigned childMask = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		childBlocks[i] = levels.get(childLevel, 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2), data);
+		if (childBlocks[i] != AIR_BLOCK) {
+			childMask |= 1 << i;
+		}
+	}
+
+	unsigned const firstChild = nodes.size();
+	nodes[nodeIndex].setChildren(firstChild, childMask);
+	for (unsigned i = 0; i < 8; ++i) {
+		if (childMask & (1 << i)) {
+			nodes.push_back(OctreeNode(childBlocks[i]));
+		}
+	}
+	unsigned child = firstChild;
+	for (unsigned i = 0; i < 8; ++i) {
+		if (childMask & (1 << i)) {
+			if (childBlocks[i] == INVALID_BLOCK) {
+				emitChildren(levels, childLevel, 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2), child, nodes, data);
+			}
+			++child;
+		}
+	}
+}
+
+template<typename ChunkData>
+void buildOctreeFrom(ChunkData const &data, Octree &octree) {
+	TimerStat::Timed timed = stats.octreeBuildTime.timed();
+	octree = Octree();
+	OctreeNodes &nodes = octree.getNodes();
+	OctreeLevels &levels = octreeLevelsScratch.get();
+	levels.build(data);
+	Block const block = levels.get(CHUNK_POWER, 0, 0, 0, data);
+	if (block != AIR_BLOCK) {
+		nodes.push_back(OctreeNode(block));
+		if (block == INVALID_BLOCK) {
+			emitChildren(levels, CHUNK_POWER, 0, 0, 0, 0, nodes, data);
+		}
+	}
+	octree.shrinkToFit();
+	stats.octreesBuilt.increment();
+	stats.octreeNodes.increment(octree.getNumNodes());
+	stats.octreeBytes.increment(octree.getSizeInBytes());
+}
+
+void buildOctree(RawChunkData const &rawChunkData, Octree &octree) {
+	buildOctreeFrom(rawChunkData, octree);
+}
+
+void buildOctree(PackedChunkData const &packedChunkData, Octree &octree) {
+	buildOctreeFrom(packedChunkData, octree);
+}
+
+void buildUniformOctree(Block block, Octree &octree) {
+	octree = Octree();
+	if (block != AIR_BLOCK) {
+		octree.getNodes().push_back(OctreeNode(block));
+	}
+	octree.shrinkToFit();
+}
+
+template<typename ChunkData>
+void unpackOctreeNodes(unsigned size, unsigned index, OctreeNode const *nodes, unsigned numNodes, unsigned base, ChunkData &data) {
 	Block block = AIR_BLOCK;
-	if ((index != 0 || size == CHUNK_SIZE) && index < nodes.size()) {
+	if ((index != 0 || size == CHUNK_SIZE) && index < numNodes) {
 		block = nodes[index].block;
 	}
 	if (block == INVALID_BLOCK) {
@@ -111,30 +389,70 @@ void unpackOctreeNodes(unsigned size, unsigned index, OctreeNodes const &nodes,
 		unsigned const sx = s;
 		unsigned const sy = CHUNK_SIZE * s;
 		unsigned const sz = CHUNK_SIZE * CHUNK_SIZE * s;
-		unpackOctreeNodes(s, node.children[0], nodes, base               );
-		unpackOctreeNodes(s, node.children[1], nodes, base +           sx);
-		unpackOctreeNodes(s, node.children[2], nodes, base +      sy     );
-		unpackOctreeNodes(s, node.children[3], nodes, base +      sy + sx);
-		unpackOctreeNodes(s, node.children[4], nodes, base + sz          );
-		unpackOctreeNodes(s, node.children[5], nodes, base + sz +      sx);
-		unpackOctreeNodes(s, node.children[6], nodes, base + sz + sy     );
-		unpackOctreeNodes(s, node.children[7], nodes, base + sz + sy + sx);
+		unpackOctreeNodes(s, node.getChild(0), nodes, numNodes, base               , data);
+		unpackOctreeNodes(s, node.getChild(1), nodes, numNodes, base +           sx, data);
+		unpackOctreeNodes(s, node.getChild(2), nodes, numNodes, base +      sy     , data);
+		unpackOctreeNodes(s, node.getChild(3), nodes, numNodes, base +      sy + sx, data);
+		unpackOctreeNodes(s, node.getChild(4), nodes, numNodes, base + sz          , data);
+		unpackOctreeNodes(s, node.getChild(5), nodes, numNodes, base + sz +      sx, data);
+		unpackOctreeNodes(s, node.getChild(6), nodes, numNodes, base + sz + sy     , data);
+		unpackOctreeNodes(s, node.getChild(7), nodes, numNodes, base + sz + sy + sx, data);
 	} else {
 		for (unsigned z = 0; z < size; ++z) {
 			for (unsigned y = 0; y < size; ++y) {
-				for (unsigned x = 0; x < size; ++x) {
-					*base = block;
-					++base;
-				}
-				base += CHUNK_SIZE - size;
+				data.fill(base + CHUNK_SIZE * CHUNK_SIZE * z + CHUNK_SIZE * y, size, block);
 			}
-			base += CHUNK_SIZE * (CHUNK_SIZE - size);
 		}
 	}
 }
 
 void unpackOctree(Octree const &octree, RawChunkData &rawChunkData) {
 	TimerStat::Timed timed = stats.octreeUnpackTime.timed();
-	unpackOctreeNodes(CHUNK_SIZE, 0, octree.getNodes(), rawChunkData.raw());
+	unpackOctreeNodes(CHUNK_SIZE, 0, octree.getNodeData(), octree.getNumNodes(), 0, rawChunkData);
 	stats.octreesUnpacked.increment();
 }
+
+void unpackOctree(Octree const &octree, PackedChunkData &packedChunkData) {
+	TimerStat::Timed timed = stats.octreeUnpackTime.timed();
+	packedChunkData.clear();
+	unpackOctreeNodes(CHUNK_SIZE, 0, octree.getNodeData(), octree.getNumNodes(), 0, packedChunkData);
+	stats.octreesUnpacked.increment();
+}
+
+void extractOctreeSlabNodes(OctreeNode const *nodes, unsigned index, unsigned const *base, unsigned size, unsigned axis, unsigned layer, Block *slab) {
+	unsigned const u = axis == 0 ? 1 : 0;
+	unsigned const v = axis == 2 ? 1 : 2;
+	OctreeNode const &node = nodes[index];
+	if (node.block != INVALID_BLOCK) {
+		for (unsigned j = base[v]; j < base[v] + size; ++j) {
+			std::fill(&slab[base[u] + CHUNK_SIZE * j], &slab[base[u] + size + CHUNK_SIZE * j], node.block);
+		}
+		return;
+	}
+	unsigned const s = size / 2;
+	// Only the children on the same side of the middle as the layer.
+	unsigned const side = layer >= base[axis] + s ? 1 << axis : 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		if ((i & (1 << axis)) != side) {
+			continue;
+		}
+		if (unsigned const child = node.getChild(i)) {
+			unsigned const childBase[3] = {
+				base[0] + (i & 1 ? s : 0),
+				base[1] + (i & 2 ? s : 0),
+				base[2] + (i & 4 ? s : 0)
+			};
+			extractOctreeSlabNodes(nodes, child, childBase, s, axis, layer, slab);
+		}
+	}
+}
+
+void extractOctreeSlab(Octree const &octree, unsigned axis, unsigned layer, std::vector<Block> &slab) {
+	BOOST_ASSERT(axis < 3 && layer < CHUNK_SIZE);
+	slab.assign(CHUNK_SIZE * CHUNK_SIZE, AIR_BLOCK);
+	if (!octree.isEmpty()) {
+		unsigned const base[3] = { 0, 0, 0 };
+		extractOctreeSlabNodes(octree.getNodeData(), 0, base, CHUNK_SIZE, axis, layer, &slab[0]);
+	}
+	stats.octreeSlabsExtracted.increment();
+}
@@ -2,23 +2,47 @@
 #define OCTREE_H
 
 #include "block.h"
+#include "coords.h"
 #include "maths.h"
 
+#include <boost/assert.hpp>
 #include <boost/shared_ptr.hpp>
 
-#include <cstring>
+#include <stdint.h>
+
 #include <vector>
 
+/* The children of a node are stored next to each other, in order, leaving out the ones that are AIR_BLOCK.
+ * So all a node needs is the index of its first child, and a mask of which children exist,
+ * packed together as (firstChild << 8) | childMask.
+ */
 struct OctreeNode {
 
 	Block block;
-	unsigned children[8];
+	uint32_t children;
 
 	explicit OctreeNode(Block block = INVALID_BLOCK)
 	:
-		block(block)
+		block(block),
+		children(0)
 	{
-		memset(children, 0, sizeof(children));
+	}
+
+	unsigned getChildMask() const { return children & 0xFF; }
+	unsigned getFirstChild() const { return children >> 8; }
+
+	// Returns 0 if the child does not exist.
+	unsigned getChild(unsigned childIndex) const {
+		unsigned const childMask = getChildMask();
+		if (!(childMask & (1 << childIndex))) {
+			return 0;
+		}
+		return getFirstChild() + __builtin_popcount(childMask & ((1 << childIndex) - 1));
+	}
+
+	void setChildren(unsigned firstChild, unsigned childMask) {
+		BOOST_ASSERT(firstChild < (1 << 24) && childMask < (1 << 8));
+		children = (firstChild << 8) | childMask;
 	}
 
 };
@@ -28,18 +52,35 @@ typedef std::vector<OctreeNode> OctreeNodes;
 class Octree {
 
 	/* A node has block == INVALID_BLOCK iff it has children.
-	 * If a child i does not exist, the corresponding entry children[i] is 0,
+	 * If a child i does not exist, the corresponding bit in its parent's child mask is 0,
 	 * and the child is implicitly filled with AIR_BLOCK.
 	 * Node 0 is the root. If it is not there, the entire chunk is AIR_BLOCK.
+	 *
+	 * The nodes are either owned by the octree, or live in memory owned by someone else,
+	 * such as a memory-mapped file, which is kept alive by externalOwner.
 	 */
 	OctreeNodes nodes;
+	OctreeNode const *externalNodes;
+	unsigned numExternalNodes;
+	boost::shared_ptr<void const> externalOwner;
 
 	public:
 
-		OctreeNodes &getNodes() { return nodes; }
-		OctreeNodes const &getNodes() const { return nodes; }
+		Octree() : externalNodes(0), numExternalNodes(0) { }
 
-		bool isEmpty() const { return nodes.size() == 0; }
+		// Only for octrees that own their nodes.
+		OctreeNodes &getNodes() { BOOST_ASSERT(!externalNodes); return nodes; }
+
+		OctreeNode const *getNodeData() const { return externalNodes ? externalNodes : (nodes.empty() ? 0 : &nodes[0]); }
+		unsigned getNumNodes() const { return externalNodes ? numExternalNodes : nodes.size(); }
+		OctreeNode const &getNode(unsigned index) const { return getNodeData()[index]; }
+
+		void setExternalNodes(OctreeNode const *nodes, unsigned numNodes, boost::shared_ptr<void const> owner);
+		// For builders to call when they are done with the nodes.
+		void shrinkToFit();
+
+		bool isEmpty() const { return getNumNodes() == 0; }
+		unsigned getSizeInBytes() const { return externalNodes ? numExternalNodes * sizeof(OctreeNode) : nodes.capacity() * sizeof(OctreeNode); }
 
 		void getBlock(int3 position, Block *block, int3 *base, unsigned *size) const;
 
@@ -49,8 +90,65 @@ typedef boost::shared_ptr<Octree> OctreePtr;
 typedef boost::shared_ptr<Octree const> OctreeConstPtr;
 
 class RawChunkData;
+class PackedChunkData;
 
+/* Builds the octree bottom-up: a single pass over the blocks merges each 2x2x2 group into a level above,
+ * and so on up to the root, after which the nodes are emitted by looking up each child's type.
+ */
 void buildOctree(RawChunkData const &rawChunkData, Octree &octree);
+void buildOctree(PackedChunkData const &packedChunkData, Octree &octree);
+
+/* Builds the same octree top-down, by checking each node for uniformity before subdividing it.
+ * Kept for comparison.
+ */
+void buildOctreeTopDown(RawChunkData const &rawChunkData, Octree &octree);
+void buildOctreeTopDown(PackedChunkData const &packedChunkData, Octree &octree);
+
+void buildUniformOctree(Block block, Octree &octree);
+
+/* For building octrees depth-first: given the 8 children of a node in consecutive slots starting at firstChild,
+ * followed by the children's subtrees, returns the node itself.
+ * That is a leaf if all children are the same leaf; otherwise, the air children are removed,
+ * and the node points to the remaining ones.
+ */
+OctreeNode mergeChildren(unsigned firstChild, OctreeNodes &nodes);
+
+/* Checks that nodes from an untrusted source, such as a file, form an octree that can be walked safely:
+ * every inner node has at least one child, and its children lie after it and within the array.
+ */
+bool isValidOctree(OctreeNode const *nodes, unsigned numNodes);
 void unpackOctree(Octree const &octree, RawChunkData &rawChunkData);
+void unpackOctree(Octree const &octree, PackedChunkData &packedChunkData);
+
+/* Copies the blocks in one layer of the chunk, at the given coordinate along the given axis (0, 1, 2 for x, y, z),
+ * into slab, indexed by u + CHUNK_SIZE * v, where u and v are the other two axes in x, y, z order.
+ * Only the nodes that intersect the layer are visited.
+ */
+void extractOctreeSlab(Octree const &octree, unsigned axis, unsigned layer, std::vector<Block> &slab);
+
+template<typename Visitor>
+void visitOctreeNodes(OctreeNode const *nodes, unsigned index, unsigned x, unsigned y, unsigned z, unsigned size, Visitor &visitor) {
+	OctreeNode const &node = nodes[index];
+	if (node.block != INVALID_BLOCK) {
+		visitor(node.block, x, y, z, size);
+		return;
+	}
+	unsigned const s = size / 2;
+	for (unsigned i = 0; i < 8; ++i) {
+		if (unsigned const child = node.getChild(i)) {
+			visitOctreeNodes(nodes, child, x + (i & 1 ? s : 0), y + (i & 2 ? s : 0), z + (i & 4 ? s : 0), s, visitor);
+		}
+	}
+}
+
+/* Calls visitor(block, x, y, z, size) for each leaf node, covering the cube of size blocks whose lowest corner is at x, y, z.
+ * The implicit air children are left out, so everything not visited is AIR_BLOCK.
+ */
+template<typename Visitor>
+void visitOctreeLeaves(Octree const &octree, Visitor &visitor) {
+	if (!octree.isEmpty()) {
+		visitOctreeNodes(octree.getNodeData(), 0, 0, 0, 0, CHUNK_SIZE, visitor);
+	}
+}
 
 #endif
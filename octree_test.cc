@@ -3,6 +3,8 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+
 BOOST_AUTO_TEST_SUITE(OctreeTest)
 
 void testConstruction(RawChunkData const &data) {
@@ -51,6 +53,16 @@ void random(RawChunkData &data) {
 	}
 }
 
+void randomPalette(RawChunkData &data, unsigned numBlocks) {
+	Block *raw = data.raw();
+	srand(0);
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		// Mostly uniform 2x2x2 cells, so that merging gets exercised beyond the first level.
+		unsigned const x = i % CHUNK_SIZE;
+		raw[i] = (x < CHUNK_SIZE / 2 && rand() % 64 != 0) ? STONE_BLOCK : rand() % numBlocks;
+	}
+}
+
 BOOST_AUTO_TEST_CASE(TestConstructEmpty) {
 	RawChunkData data;
 	empty(data);
@@ -75,9 +87,14 @@ BOOST_AUTO_TEST_CASE(TestConstructHalfFull) {
 	buildOctree(data, octree);
 	BOOST_REQUIRE_EQUAL(5, octree.getNodes().size());
 	BOOST_REQUIRE_EQUAL((Block)INVALID_BLOCK, octree.getNodes()[0].block);
-	unsigned children[8] = { 1, 2, 3, 4, 0, 0, 0, 0 };
-	BOOST_REQUIRE_EQUAL_COLLECTIONS(children, children + 8,
-			octree.getNodes()[0].children, octree.getNodes()[0].children + 8);
+	BOOST_REQUIRE_EQUAL(0x0Fu, octree.getNodes()[0].getChildMask());
+	BOOST_REQUIRE_EQUAL(1u, octree.getNodes()[0].getFirstChild());
+	unsigned expectedChildren[8] = { 1, 2, 3, 4, 0, 0, 0, 0 };
+	unsigned children[8];
+	for (unsigned i = 0; i < 8; ++i) {
+		children[i] = octree.getNodes()[0].getChild(i);
+	}
+	BOOST_REQUIRE_EQUAL_COLLECTIONS(expectedChildren, expectedChildren + 8, children, children + 8);
 }
 
 BOOST_AUTO_TEST_CASE(TestConstructCornerBlock) {
@@ -140,4 +157,163 @@ BOOST_AUTO_TEST_CASE(TestDeconstructRandom) {
 	testConstruction(data);
 }
 
+BOOST_AUTO_TEST_CASE(TestUnpackRandom) {
+	RawChunkData data;
+	random(data);
+	Octree octree;
+	buildOctree(data, octree);
+	RawChunkData unpacked;
+	unpackOctree(octree, unpacked);
+	BOOST_REQUIRE(std::equal(data.begin(), data.end(), unpacked.begin()));
+}
+
+void pack(RawChunkData const &raw, PackedChunkData &packed) {
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		packed.set(i, raw.get(i));
+	}
+}
+
+void requireSameNodes(Octree const &a, Octree const &b) {
+	BOOST_REQUIRE_EQUAL(a.getNumNodes(), b.getNumNodes());
+	for (unsigned i = 0; i < a.getNumNodes(); ++i) {
+		BOOST_REQUIRE_EQUAL(a.getNode(i).block, b.getNode(i).block);
+		BOOST_REQUIRE_EQUAL(a.getNode(i).children, b.getNode(i).children);
+	}
+}
+
+void testPackedConstruction(RawChunkData const &data) {
+	PackedChunkData packed;
+	pack(data, packed);
+	Octree fromRaw;
+	buildOctree(data, fromRaw);
+	Octree fromPacked;
+	buildOctree(packed, fromPacked);
+	requireSameNodes(fromRaw, fromPacked);
+
+	PackedChunkData unpacked;
+	unpackOctree(fromPacked, unpacked);
+	for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+		BOOST_REQUIRE_EQUAL(data.get(i), unpacked.get(i));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedHalfFull) {
+	RawChunkData data;
+	halfFull(data);
+	testPackedConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedCenterBlock) {
+	RawChunkData data;
+	singleBlock(data, CHUNK_SIZE / 2, CHUNK_SIZE / 2, CHUNK_SIZE / 2);
+	testPackedConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedRandom) {
+	RawChunkData data;
+	random(data);
+	testPackedConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestPackedRandomPalettes) {
+	unsigned const numBlocks[] = { 3, 5, 17, 300 };
+	for (unsigned i = 0; i < 4; ++i) {
+		RawChunkData data;
+		randomPalette(data, numBlocks[i]);
+		testPackedConstruction(data);
+	}
+}
+
+void testTopDownConstruction(RawChunkData const &data) {
+	Octree bottomUp;
+	buildOctree(data, bottomUp);
+	Octree topDown;
+	buildOctreeTopDown(data, topDown);
+	requireSameNodes(bottomUp, topDown);
+
+	PackedChunkData packed;
+	pack(data, packed);
+	Octree packedTopDown;
+	buildOctreeTopDown(packed, packedTopDown);
+	requireSameNodes(bottomUp, packedTopDown);
+}
+
+BOOST_AUTO_TEST_CASE(TestTopDownEmpty) {
+	RawChunkData data;
+	empty(data);
+	testTopDownConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestTopDownFull) {
+	RawChunkData data;
+	full(data);
+	testTopDownConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestTopDownHalfFull) {
+	RawChunkData data;
+	halfFull(data);
+	testTopDownConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestTopDownCornerBlock) {
+	RawChunkData data;
+	singleBlock(data, 0, 0, 0);
+	testTopDownConstruction(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestTopDownRandom) {
+	RawChunkData data;
+	random(data);
+	testTopDownConstruction(data);
+}
+
+void testSlabs(RawChunkData const &data) {
+	Octree octree;
+	buildOctree(data, octree);
+	std::vector<Block> slab;
+	unsigned const layers[] = { 0, 1, CHUNK_SIZE / 2, CHUNK_SIZE - 1 };
+	for (unsigned axis = 0; axis < 3; ++axis) {
+		unsigned const u = axis == 0 ? 1 : 0;
+		unsigned const v = axis == 2 ? 1 : 2;
+		for (unsigned l = 0; l < 4; ++l) {
+			extractOctreeSlab(octree, axis, layers[l], slab);
+			BOOST_REQUIRE_EQUAL(CHUNK_SIZE * CHUNK_SIZE, slab.size());
+			for (unsigned j = 0; j < CHUNK_SIZE; ++j) {
+				for (unsigned i = 0; i < CHUNK_SIZE; ++i) {
+					int c[3];
+					c[axis] = layers[l];
+					c[u] = i;
+					c[v] = j;
+					BOOST_REQUIRE_EQUAL(data[int3(c[0], c[1], c[2])], slab[i + CHUNK_SIZE * j]);
+				}
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestSlabEmpty) {
+	RawChunkData data;
+	empty(data);
+	testSlabs(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestSlabHalfFull) {
+	RawChunkData data;
+	halfFull(data);
+	testSlabs(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestSlabCornerBlock) {
+	RawChunkData data;
+	singleBlock(data, CHUNK_SIZE - 1, 0, 1);
+	testSlabs(data);
+}
+
+BOOST_AUTO_TEST_CASE(TestSlabRandomPalette) {
+	RawChunkData data;
+	randomPalette(data, 5);
+	testSlabs(data);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,249 @@
+#include "rowmask.h"
+
+#include "chunkdata.h"
+#include "coords.h"
+#include "octree.h"
+
+#include <boost/assert.hpp>
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+	// Sets the bits of the blocks that equal the given block, or of those that don't if invert is set.
+	void computeMatchMasks(PackedChunkData const &data, Block block, bool invert, RowMask *masks) {
+		BOOST_ASSERT(CHUNK_SIZE == 128);
+		unsigned const numRows = CHUNK_SIZE * CHUNK_SIZE;
+		uint64_t invertBits = invert ? ~(uint64_t)0 : 0;
+
+		std::vector<Block> const &palette = data.getPalette();
+		std::vector<Block>::const_iterator const found = std::find(palette.begin(), palette.end(), block);
+		if (found == palette.end()) {
+			RowMask row;
+			row.words[0] = row.words[1] = invertBits;
+			std::fill(masks, masks + numRows, row);
+			return;
+		}
+		unsigned const code = found - palette.begin();
+
+		if (data.getBitsPerBlock() == 1) {
+			// The words are the mask of code 1, and their complement is the mask of code 0.
+			if (code == 0) {
+				invertBits = ~invertBits;
+			}
+			for (unsigned r = 0, index = 0; r < numRows; ++r) {
+				for (unsigned w = 0; w < 2; ++w, index += 64) {
+					uint64_t const bits = data.getWord(index) | (uint64_t)data.getWord(index + 32) << 32;
+					masks[r].words[w] = bits ^ invertBits;
+				}
+			}
+			return;
+		}
+
+		for (unsigned r = 0, index = 0; r < numRows; ++r) {
+			for (unsigned w = 0; w < 2; ++w) {
+				uint64_t bits = 0;
+				for (unsigned x = 0; x < 64; ++x, ++index) {
+					bits |= (uint64_t)(data.getCode(index) == code) << x;
+				}
+				masks[r].words[w] = bits ^ invertBits;
+			}
+		}
+	}
+
+
+	// The bits from x up to, but not including, x + size.
+	inline RowMask runMask(unsigned x, unsigned size) {
+		RowMask run;
+		for (unsigned w = 0; w < 2; ++w) {
+			unsigned const begin = std::max(x, 64 * w);
+			unsigned const end = std::min(x + size, 64 * (w + 1));
+			run.words[w] = begin < end ? (~(uint64_t)0 >> (64 - (end - begin))) << (begin - 64 * w) : 0;
+		}
+		return run;
+	}
+
+	// Sets the bits of the octree leaves that match the given block, or of those that don't if invert is set.
+	class LeafMasker {
+
+		Block const block;
+		bool const invert;
+		RowMask *const masks;
+
+		public:
+
+			LeafMasker(Block block, bool invert, RowMask *masks)
+			:
+				block(block),
+				invert(invert),
+				masks(masks)
+			{
+			}
+
+			void operator()(Block leafBlock, unsigned x, unsigned y, unsigned z, unsigned size) {
+				if ((leafBlock == block) == invert) {
+					return;
+				}
+				RowMask const run = runMask(x, size);
+				for (unsigned j = z; j < z + size; ++j) {
+					for (RowMask *row = &masks[y + CHUNK_SIZE * j], *end = row + size; row != end; ++row) {
+						row->words[0] |= run.words[0];
+						row->words[1] |= run.words[1];
+					}
+				}
+			}
+
+	};
+
+	void computeLeafMasks(Octree const &octree, Block block, bool invert, RowMask *masks) {
+		BOOST_ASSERT(CHUNK_SIZE == 128);
+		BOOST_ASSERT(block == AIR_BLOCK ? invert : !invert);
+		std::fill(masks, masks + CHUNK_SIZE * CHUNK_SIZE, RowMask());
+		LeafMasker masker(block, invert, masks);
+		visitOctreeLeaves(octree, masker);
+	}
+
+#ifdef __SSE2__
+
+	inline __m128i load(RowMask const &row) {
+		return _mm_loadu_si128(reinterpret_cast<__m128i const*>(row.words));
+	}
+
+	inline void store(RowMask &row, __m128i bits) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(row.words), bits);
+	}
+
+	inline void andNotRow(RowMask const &a, RowMask const &b, RowMask &out) {
+		store(out, _mm_andnot_si128(load(b), load(a)));
+	}
+
+	// There is no 128-bit bit shift, so the bit crossing the middle is moved separately.
+	inline void andNotRowNextX(RowMask const &a, RowMask const &b, RowMask const &beyond, RowMask &out) {
+		__m128i const bits = load(b);
+		__m128i const shifted = _mm_or_si128(
+				_mm_or_si128(_mm_srli_epi64(bits, 1), _mm_slli_epi64(_mm_srli_si128(bits, 8), 63)),
+				_mm_slli_si128(_mm_slli_epi64(load(beyond), 63), 8));
+		store(out, _mm_andnot_si128(shifted, load(a)));
+	}
+
+	inline void andNotRowPrevX(RowMask const &a, RowMask const &b, RowMask const &beyond, RowMask &out) {
+		__m128i const bits = load(b);
+		__m128i const shifted = _mm_or_si128(
+				_mm_or_si128(_mm_slli_epi64(bits, 1), _mm_srli_epi64(_mm_slli_si128(bits, 8), 63)),
+				_mm_srli_si128(_mm_srli_epi64(load(beyond), 63), 8));
+		store(out, _mm_andnot_si128(shifted, load(a)));
+	}
+
+#else
+
+	inline void andNotRow(RowMask const &a, RowMask const &b, RowMask &out) {
+		out.words[0] = a.words[0] & ~b.words[0];
+		out.words[1] = a.words[1] & ~b.words[1];
+	}
+
+	inline void andNotRowNextX(RowMask const &a, RowMask const &b, RowMask const &beyond, RowMask &out) {
+		out.words[0] = a.words[0] & ~(b.words[0] >> 1 | b.words[1] << 63);
+		out.words[1] = a.words[1] & ~(b.words[1] >> 1 | beyond.words[0] << 63);
+	}
+
+	inline void andNotRowPrevX(RowMask const &a, RowMask const &b, RowMask const &beyond, RowMask &out) {
+		out.words[0] = a.words[0] & ~(b.words[0] << 1 | beyond.words[1] >> 63);
+		out.words[1] = a.words[1] & ~(b.words[1] << 1 | b.words[0] >> 63);
+	}
+
+#endif
+
+#ifdef __AVX2__
+
+	// Two rows at a time. The byte shifts work within each 128-bit lane, so each row is shifted on its own.
+
+	inline __m256i load2(RowMask const *rows) {
+		return _mm256_loadu_si256(reinterpret_cast<__m256i const*>(rows));
+	}
+
+	inline void store2(RowMask *rows, __m256i bits) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(rows), bits);
+	}
+
+	inline void andNotRows2(RowMask const *a, RowMask const *b, RowMask *out) {
+		store2(out, _mm256_andnot_si256(load2(b), load2(a)));
+	}
+
+	inline void andNotRows2NextX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out) {
+		__m256i const bits = load2(b);
+		__m256i const shifted = _mm256_or_si256(
+				_mm256_or_si256(_mm256_srli_epi64(bits, 1), _mm256_slli_epi64(_mm256_srli_si256(bits, 8), 63)),
+				_mm256_slli_si256(_mm256_slli_epi64(load2(beyond), 63), 8));
+		store2(out, _mm256_andnot_si256(shifted, load2(a)));
+	}
+
+	inline void andNotRows2PrevX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out) {
+		__m256i const bits = load2(b);
+		__m256i const shifted = _mm256_or_si256(
+				_mm256_or_si256(_mm256_slli_epi64(bits, 1), _mm256_srli_epi64(_mm256_slli_si256(bits, 8), 63)),
+				_mm256_srli_si256(_mm256_srli_epi64(load2(beyond), 63), 8));
+		store2(out, _mm256_andnot_si256(shifted, load2(a)));
+	}
+
+#endif
+
+}
+
+void computeRowMasks(PackedChunkData const &data, Block block, RowMask *masks) {
+	computeMatchMasks(data, block, false, masks);
+}
+
+void computeOccupancyMasks(PackedChunkData const &data, RowMask *masks) {
+	computeMatchMasks(data, AIR_BLOCK, true, masks);
+}
+
+void computeRowMasks(Octree const &octree, Block block, RowMask *masks) {
+	computeLeafMasks(octree, block, false, masks);
+}
+
+void computeOccupancyMasks(Octree const &octree, RowMask *masks) {
+	computeLeafMasks(octree, AIR_BLOCK, true, masks);
+}
+
+void andNotRows(RowMask const *a, RowMask const *b, RowMask *out, unsigned count) {
+	unsigned i = 0;
+#ifdef __AVX2__
+	for (; i + 2 <= count; i += 2) {
+		andNotRows2(a + i, b + i, out + i);
+	}
+#endif
+	for (; i < count; ++i) {
+		andNotRow(a[i], b[i], out[i]);
+	}
+}
+
+void andNotRowsNextX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out, unsigned count) {
+	unsigned i = 0;
+#ifdef __AVX2__
+	for (; i + 2 <= count; i += 2) {
+		andNotRows2NextX(a + i, b + i, beyond + i, out + i);
+	}
+#endif
+	for (; i < count; ++i) {
+		andNotRowNextX(a[i], b[i], beyond[i], out[i]);
+	}
+}
+
+void andNotRowsPrevX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out, unsigned count) {
+	unsigned i = 0;
+#ifdef __AVX2__
+	for (; i + 2 <= count; i += 2) {
+		andNotRows2PrevX(a + i, b + i, beyond + i, out + i);
+	}
+#endif
+	for (; i < count; ++i) {
+		andNotRowPrevX(a[i], b[i], beyond[i], out[i]);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef ROWMASK_H
+#define ROWMASK_H
+
+#include "block.h"
+
+#include <stdint.h>
+
+class Octree;
+class PackedChunkData;
+
+/* One bit for each block in a row of a chunk along the x axis; bit x is in words[x / 64].
+ * A row of CHUNK_SIZE = 128 blocks fits exactly, which is also the width of an SSE register.
+ * Rows are indexed by y + CHUNK_SIZE * z, so a chunk has CHUNK_SIZE * CHUNK_SIZE of them.
+ */
+struct RowMask {
+	uint64_t words[2];
+
+	bool test(unsigned x) const { return (words[x >> 6] >> (x & 63)) & 1; }
+	void set(unsigned x) { words[x >> 6] |= (uint64_t)1 << (x & 63); }
+	bool isEmpty() const { return !(words[0] | words[1]); }
+};
+
+/* Sets the bits of the blocks that equal the given block, for all rows of the chunk.
+ * At one bit per block, the rows are copied straight from the packed words.
+ */
+void computeRowMasks(PackedChunkData const &data, Block block, RowMask *masks);
+// Sets the bits of the blocks that are not AIR_BLOCK.
+void computeOccupancyMasks(PackedChunkData const &data, RowMask *masks);
+
+/* The same, straight from the leaves of an octree, setting a run of bits in each row a leaf covers.
+ * Since the air is left implicit in the octree, the block must not be AIR_BLOCK.
+ */
+void computeRowMasks(Octree const &octree, Block block, RowMask *masks);
+void computeOccupancyMasks(Octree const &octree, RowMask *masks);
+
+/* The face-culling kernels, each run over count consecutive rows.
+ * They use SSE2 or AVX2 where the compiler targets it.
+ */
+
+// out = a & ~b.
+void andNotRows(RowMask const *a, RowMask const *b, RowMask *out, unsigned count);
+// out = a & ~(b at x + 1), where bit CHUNK_SIZE of a row of b is the lowest bit of the same row of beyond.
+void andNotRowsNextX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out, unsigned count);
+// out = a & ~(b at x - 1), where bit -1 of a row of b is the highest bit of the same row of beyond.
+void andNotRowsPrevX(RowMask const *a, RowMask const *b, RowMask const *beyond, RowMask *out, unsigned count);
+
+#endif
@@ -0,0 +1,115 @@
+#include "rowmask.h"
+
+#include "chunkdata.h"
+#include "octree.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib>
+#include <vector>
+
+namespace {
+	RowMask randomRow() {
+		RowMask row;
+		for (unsigned w = 0; w < 2; ++w) {
+			row.words[w] = 0;
+			for (unsigned i = 0; i < 4; ++i) {
+				row.words[w] = row.words[w] << 16 ^ (uint64_t)(rand() & 0xFFFF);
+			}
+		}
+		return row;
+	}
+
+	void testComputeRowMasks(unsigned numBlocks) {
+		PackedChunkData data;
+		srand(numBlocks);
+		for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+			data.set(i, rand() % numBlocks);
+		}
+		std::vector<RowMask> masks(CHUNK_SIZE * CHUNK_SIZE);
+		for (Block block = 0; block <= numBlocks; ++block) {
+			computeRowMasks(data, block, &masks[0]);
+			for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+				BOOST_REQUIRE_EQUAL(data.get(i) == block, masks[i / CHUNK_SIZE].test(i % CHUNK_SIZE));
+			}
+		}
+		computeOccupancyMasks(data, &masks[0]);
+		for (unsigned i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+			BOOST_REQUIRE_EQUAL(data.get(i) != AIR_BLOCK, masks[i / CHUNK_SIZE].test(i % CHUNK_SIZE));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE(RowMaskTest)
+
+BOOST_AUTO_TEST_CASE(TestComputeRowMasksOneBit) {
+	testComputeRowMasks(2);
+}
+
+BOOST_AUTO_TEST_CASE(TestComputeRowMasksWide) {
+	testComputeRowMasks(3);
+	testComputeRowMasks(20);
+}
+
+BOOST_AUTO_TEST_CASE(TestOctreeRowMasks) {
+	PackedChunkData data;
+	srand(0);
+	// Boxes of a few blocks, so that the octree has leaves of several sizes.
+	for (unsigned i = 0; i < 200; ++i) {
+		unsigned const size = 1 << (rand() % 6);
+		unsigned const x = rand() % (CHUNK_SIZE - size + 1);
+		unsigned const y = rand() % (CHUNK_SIZE - size + 1);
+		unsigned const z = rand() % (CHUNK_SIZE - size + 1);
+		Block const block = rand() % 3;
+		for (unsigned k = z; k < z + size; ++k) {
+			for (unsigned j = y; j < y + size; ++j) {
+				data.fill(x + CHUNK_SIZE * j + CHUNK_SIZE * CHUNK_SIZE * k, size, block);
+			}
+		}
+	}
+	Octree octree;
+	buildOctree(data, octree);
+
+	std::vector<RowMask> expected(CHUNK_SIZE * CHUNK_SIZE);
+	std::vector<RowMask> actual(CHUNK_SIZE * CHUNK_SIZE);
+	for (Block block = 1; block <= 3; ++block) {
+		computeRowMasks(data, block, &expected[0]);
+		computeRowMasks(octree, block, &actual[0]);
+		for (unsigned r = 0; r < expected.size(); ++r) {
+			BOOST_REQUIRE_EQUAL(expected[r].words[0], actual[r].words[0]);
+			BOOST_REQUIRE_EQUAL(expected[r].words[1], actual[r].words[1]);
+		}
+	}
+	computeOccupancyMasks(data, &expected[0]);
+	computeOccupancyMasks(octree, &actual[0]);
+	for (unsigned r = 0; r < expected.size(); ++r) {
+		BOOST_REQUIRE_EQUAL(expected[r].words[0], actual[r].words[0]);
+		BOOST_REQUIRE_EQUAL(expected[r].words[1], actual[r].words[1]);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestAndNotRows) {
+	unsigned const count = 7;
+	std::vector<RowMask> a, b, beyond;
+	srand(0);
+	for (unsigned i = 0; i < count; ++i) {
+		a.push_back(randomRow());
+		b.push_back(randomRow());
+		beyond.push_back(randomRow());
+	}
+	std::vector<RowMask> out(count), next(count), prev(count);
+	andNotRows(&a[0], &b[0], &out[0], count);
+	andNotRowsNextX(&a[0], &b[0], &beyond[0], &next[0], count);
+	andNotRowsPrevX(&a[0], &b[0], &beyond[0], &prev[0], count);
+	for (unsigned i = 0; i < count; ++i) {
+		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
+			bool const nextB = x + 1 < CHUNK_SIZE ? b[i].test(x + 1) : beyond[i].test(0);
+			bool const prevB = x > 0 ? b[i].test(x - 1) : beyond[i].test(CHUNK_SIZE - 1);
+			BOOST_REQUIRE_EQUAL(a[i].test(x) && !b[i].test(x), out[i].test(x));
+			BOOST_REQUIRE_EQUAL(a[i].test(x) && !nextB, next[i].test(x));
+			BOOST_REQUIRE_EQUAL(a[i].test(x) && !prevB, prev[i].test(x));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
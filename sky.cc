@@ -1,5 +1,7 @@
 #include "sky.h"
 
+#include "trace.h"
+
 #include <boost/assert.hpp>
 
 #include <algorithm>
@@ -51,6 +53,8 @@ void Sky::update(float dt) {
 }
 
 void Sky::render() {
+	TraceSpan span("Sky::render");
+
 	glDisable(GL_DEPTH_TEST);
 	glDepthMask(GL_FALSE);
 
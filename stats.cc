@@ -1,32 +1,129 @@
 #include "stats.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
+__thread unsigned currentStatShardPlusOne = 0;
+
+unsigned assignStatShard() {
+	static boost::atomic<unsigned> nextShard(0);
+	unsigned const shard = nextShard.fetch_add(1, boost::memory_order_relaxed) % NUM_STAT_SHARDS;
+	currentStatShardPlusOne = shard + 1;
+	return shard;
+}
+
+HistogramStat::HistogramStat() {
+	for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+		buckets[i].store(0, boost::memory_order_relaxed);
+	}
+	count.store(0, boost::memory_order_relaxed);
+	maxNanoseconds.store(0, boost::memory_order_relaxed);
+}
+
+void HistogramStat::record(double seconds) {
+	uint64_t const nanoseconds = seconds > 0 ? (uint64_t)(1e9 * seconds + 0.5) : 0;
+	buckets[bucketIndex(nanoseconds)].fetch_add(1, boost::memory_order_relaxed);
+	count.fetch_add(1, boost::memory_order_relaxed);
+	uint64_t max = maxNanoseconds.load(boost::memory_order_relaxed);
+	while (nanoseconds > max && !maxNanoseconds.compare_exchange_weak(max, nanoseconds, boost::memory_order_relaxed)) {
+	}
+}
+
+unsigned long HistogramStat::getCount() const {
+	return count.load(boost::memory_order_relaxed);
+}
+
+double HistogramStat::getPercentile(double p) const {
+	unsigned long const total = getCount();
+	if (total == 0) {
+		return 0;
+	}
+	unsigned long const rank = std::max(1ul, (unsigned long)ceil(p * total));
+	unsigned long seen = 0;
+	for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+		seen += buckets[i].load(boost::memory_order_relaxed);
+		if (seen >= rank) {
+			return std::min(bucketMiddle(i), getMax());
+		}
+	}
+	return getMax();
+}
+
+double HistogramStat::getMax() const {
+	return 1e-9 * maxNanoseconds.load(boost::memory_order_relaxed);
+}
+
+unsigned HistogramStat::bucketIndex(uint64_t nanoseconds) {
+	if (nanoseconds < NUM_SUB_BUCKETS) {
+		return (unsigned)nanoseconds;
+	}
+	unsigned const exponent = 63 - __builtin_clzll(nanoseconds);
+	unsigned const shift = exponent - SUB_BUCKET_BITS;
+	unsigned const mantissa = (unsigned)(nanoseconds >> shift) & (NUM_SUB_BUCKETS - 1);
+	return (shift + 1) * NUM_SUB_BUCKETS + mantissa;
+}
+
+double HistogramStat::bucketMiddle(unsigned index) {
+	if (index < NUM_SUB_BUCKETS) {
+		return 1e-9 * index;
+	}
+	unsigned const shift = index / NUM_SUB_BUCKETS - 1;
+	unsigned const mantissa = index % NUM_SUB_BUCKETS;
+	uint64_t const min = (uint64_t)(NUM_SUB_BUCKETS + mantissa) << shift;
+	uint64_t const width = (uint64_t)1 << shift;
+	return 1e-9 * (min + 0.5 * (width - 1));
+}
+
+std::ostream &operator<<(std::ostream &out, HistogramStat const &histogram) {
+	return out
+		<< "p50 " << histogram.getPercentile(0.50)
+		<< ", p95 " << histogram.getPercentile(0.95)
+		<< ", p99 " << histogram.getPercentile(0.99)
+		<< ", max " << histogram.getMax();
+}
+
 Stats stats;
 
 void Stats::print() const {
 	std::cout
 		<< "Chunks created: " << chunksCreated.get() << '\n'
 		<< "Chunks evicted: " << chunksEvicted.get() << '\n'
+		<< "Chunks removed: " << chunksRemoved.get() << '\n'
 		<< '\n'
+		<< "Chunks loaded: " << chunksLoaded.get() << '\n'
+		<< "Chunks saved: " << chunksSaved.get() << '\n'
 		<< "Chunks generated: " << chunksGenerated.get() << '\n'
+		<< "Uniform chunks generated: " << uniformChunksGenerated.get() << '\n'
 		<< "Generation time per chunk: " << (chunkGenerationTime.get() / chunksGenerated.get()) << '\n'
+		<< "Generation time percentiles: " << chunkGenerationTime.getHistogram() << '\n'
+		<< "Octrees generated directly: " << octreesGenerated.get() << '\n'
 		<< "Octrees built: " << octreesBuilt.get() << '\n'
 		<< "Build time per octree: " << (octreeBuildTime.get() / octreesBuilt.get()) << '\n'
+		<< "Build time percentiles: " << octreeBuildTime.getHistogram() << '\n'
 		<< "Chunks tesselated: " << chunksTesselated.get() << '\n'
 		<< "Tesselation time per chunk: " << (chunkTesselationTime.get() / chunksTesselated.get()) << '\n'
+		<< "Tesselation time percentiles: " << chunkTesselationTime.getHistogram() << '\n'
+		<< "Tesselations skipped: " << tesselationsSkipped.get() << '\n'
 		<< '\n'
 		<< "Irrelevant jobs skipped: " << irrelevantJobsSkipped.get() << '\n'
 		<< "Irrelevant jobs run: " << irrelevantJobsRun.get() << '\n'
 		<< '\n'
 		<< "Octree nodes built: " << octreeNodes.get() << '\n'
-		<< "Nodes per octree: " << ((float)octreeNodes.get() / octreesBuilt.get()) << '\n'
+		<< "Nodes per octree: " << ((float)octreeNodes.get() / (octreesBuilt.get() + octreesGenerated.get())) << '\n'
+		<< "Octree bytes built: " << octreeBytes.get() << '\n'
+		<< "Bytes per octree: " << ((float)octreeBytes.get() / (octreesBuilt.get() + octreesGenerated.get())) << '\n'
 		<< "Octrees unpacked: " << octreesUnpacked.get() << '\n'
 		<< "Unpack time per octree: " << (octreeUnpackTime.get() / octreesUnpacked.get()) << '\n'
+		<< "Unpack time percentiles: " << octreeUnpackTime.getHistogram() << '\n'
+		<< "Octree slabs extracted: " << octreeSlabsExtracted.get() << '\n'
 		<< "Quads generated: " << quadsGenerated.get() << '\n'
 		<< "Quads per chunk: " << ((float)quadsGenerated.get() / chunksGenerated.get()) << '\n'
 		<< "Raycast cache hits: " << raycastCacheHits.get() << '\n'
 		<< "Raycast cache misses: " << raycastCacheMisses.get() << '\n'
+		<< "Raycast cache hit rate: " << ((float)raycastCacheHits.get() / (raycastCacheHits.get() + raycastCacheMisses.get())) << '\n'
+		<< "Raycast cache entries per chunk: " << ((float)raycastCacheEntries.get() / chunksTesselated.get()) << '\n'
+		<< "Raycast cache bytes per chunk: " << ((float)raycastCacheBytes.get() / chunksTesselated.get()) << '\n'
 		<< '\n'
 		<< "Chunks considered for rendering: " << chunksConsidered.get() << '\n'
 		<< "Chunks skipped: " << chunksSkipped.get() << '\n'
@@ -47,5 +144,6 @@ void Stats::print() const {
 		<< "Running time: " << runningTime.get() << '\n'
 		<< "Frames rendered: " << framesRendered.get() << '\n'
 		<< "Frames per second: " << (framesRendered.get() / runningTime.get()) << '\n'
+		<< "Frame time percentiles: " << runningTime.getHistogram() << '\n'
 		;
 }
@@ -1,44 +1,121 @@
 #ifndef STATS_H
 #define STATS_H
 
+#include <boost/atomic.hpp>
 #include <boost/noncopyable.hpp>
-#include <boost/thread.hpp>
+
+#include <stdint.h>
 
 #include <ctime>
+#include <ostream>
+
+unsigned const NUM_STAT_SHARDS = 16;
+unsigned const CACHE_LINE_SIZE = 64;
+
+// One plus the index of the shard that the current thread updates, or zero if it has not been assigned yet.
+extern __thread unsigned currentStatShardPlusOne;
+
+unsigned assignStatShard();
 
+inline unsigned currentStatShard() {
+	unsigned const shardPlusOne = currentStatShardPlusOne;
+	return shardPlusOne ? shardPlusOne - 1 : assignStatShard();
+}
+
+/* A statistic that can be updated from many threads at once without them getting in each other's way.
+ * Each thread adds to its own shard, which lives on its own cache line; get() adds up all shards.
+ * Threads are assigned shards round-robin, so only if there are more threads than shards
+ * do some of them share one, and even then the updates remain atomic.
+ */
 template<typename T>
-class Stat {
+class Stat
+:
+	boost::noncopyable
+{
+
+	// Aligning the shard also rounds its size up to a whole cache line. Only static and automatic
+	// storage honours the alignment before C++17, so stats must not be allocated with new.
+	struct Shard {
+		boost::atomic<T> value;
+	} __attribute__((aligned(CACHE_LINE_SIZE)));
 
-	boost::shared_mutex mutable mutex;
-	T value;
+	Shard shards[NUM_STAT_SHARDS];
 
 	public:
 
-		Stat()
-		:
-			value(0)
-		{
+		Stat() {
+			for (unsigned i = 0; i < NUM_STAT_SHARDS; ++i) {
+				shards[i].value.store(0, boost::memory_order_relaxed);
+			}
 		}
 
 		void increment(T delta = 1) {
-			boost::unique_lock<boost::shared_mutex> lock(mutex);
-			value += delta;
+			boost::atomic<T> &value = shards[currentStatShard()].value;
+			T old = value.load(boost::memory_order_relaxed);
+			while (!value.compare_exchange_weak(old, old + delta, boost::memory_order_relaxed)) {
+			}
 		}
 
 		T get() const {
-			boost::shared_lock<boost::shared_mutex> lock(mutex);
-			return value;
+			T sum = 0;
+			for (unsigned i = 0; i < NUM_STAT_SHARDS; ++i) {
+				sum += shards[i].value.load(boost::memory_order_relaxed);
+			}
+			return sum;
 		}
 
 };
 
 typedef Stat<unsigned long> CounterStat;
 
+/* A histogram of durations with logarithmic buckets, in the style of HdrHistogram.
+ * Durations are counted in nanoseconds; every power of two is split into 16 linear buckets,
+ * so percentiles are accurate to within about 3%. The maximum is kept exactly.
+ * Meant for events that happen at most a few times per frame per thread,
+ * so the buckets are plain atomics rather than sharded like Stat.
+ */
+class HistogramStat
+:
+	boost::noncopyable
+{
+
+	enum {
+		SUB_BUCKET_BITS = 4,
+		NUM_SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+		NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * NUM_SUB_BUCKETS
+	};
+
+	boost::atomic<unsigned long> buckets[NUM_BUCKETS];
+	boost::atomic<unsigned long> count;
+	boost::atomic<uint64_t> maxNanoseconds;
+
+	public:
+
+		HistogramStat();
+
+		void record(double seconds);
+
+		unsigned long getCount() const;
+		// p is between 0 and 1. Returns 0 if nothing has been recorded.
+		double getPercentile(double p) const;
+		double getMax() const;
+
+	private:
+
+		static unsigned bucketIndex(uint64_t nanoseconds);
+		static double bucketMiddle(unsigned index);
+
+};
+
+std::ostream &operator<<(std::ostream &out, HistogramStat const &histogram);
+
 class TimerStat
 :
 	Stat<double>
 {
 
+	HistogramStat histogram;
+
 	public:
 
 		class Timed {
@@ -63,7 +140,7 @@ class TimerStat
 						timespec end;
 						clock_gettime(CLOCK_MONOTONIC, &end);
 						double delta = end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec);
-						parent->increment(delta);
+						parent->record(delta);
 					}
 				}
 
@@ -85,27 +162,47 @@ class TimerStat
 
 		using Stat<double>::get;
 
+		HistogramStat const &getHistogram() const { return histogram; }
+
+	private:
+
+		void record(double seconds) {
+			increment(seconds);
+			histogram.record(seconds);
+		}
+
 };
 
 struct Stats {
 	TimerStat runningTime;
 
 	CounterStat octreeNodes;
+	CounterStat octreeBytes;
 	CounterStat quadsGenerated;
 
 	CounterStat chunksCreated;
 	CounterStat chunksEvicted;
+	CounterStat chunksRemoved;
+
+	CounterStat chunksLoaded;
+	CounterStat chunksSaved;
 
 	CounterStat chunksGenerated;
+	CounterStat uniformChunksGenerated;
 	TimerStat chunkGenerationTime;
 	CounterStat octreesBuilt;
+	CounterStat octreesGenerated;
 	TimerStat octreeBuildTime;
 	CounterStat octreesUnpacked;
 	TimerStat octreeUnpackTime;
+	CounterStat octreeSlabsExtracted;
 	CounterStat chunksTesselated;
+	CounterStat tesselationsSkipped;
 	TimerStat chunkTesselationTime;
 	CounterStat raycastCacheHits;
 	CounterStat raycastCacheMisses;
+	CounterStat raycastCacheEntries;
+	CounterStat raycastCacheBytes;
 
 	CounterStat irrelevantJobsSkipped;
 	CounterStat irrelevantJobsRun;
@@ -0,0 +1,71 @@
+#include "stats.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(StatsTest)
+
+namespace {
+	void incrementMany(CounterStat *counter, unsigned n) {
+		for (unsigned i = 0; i < n; ++i) {
+			counter->increment();
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestIncrement) {
+	Stat<double> stat;
+	BOOST_CHECK_EQUAL(0.0, stat.get());
+	stat.increment(0.5);
+	stat.increment(1.5);
+	BOOST_CHECK_EQUAL(2.0, stat.get());
+}
+
+BOOST_AUTO_TEST_CASE(TestConcurrentIncrements) {
+	// More threads than shards, so some of them have to share.
+	unsigned const numThreads = NUM_STAT_SHARDS + 4;
+	unsigned const n = 10000;
+	CounterStat counter;
+	boost::thread_group threads;
+	for (unsigned i = 0; i < numThreads; ++i) {
+		threads.create_thread(boost::bind(&incrementMany, &counter, n));
+	}
+	threads.join_all();
+	BOOST_CHECK_EQUAL(numThreads * n, counter.get());
+}
+
+BOOST_AUTO_TEST_CASE(TestShardsFillCacheLines) {
+	CounterStat counter;
+	BOOST_CHECK_EQUAL(CACHE_LINE_SIZE * NUM_STAT_SHARDS, sizeof(counter));
+	BOOST_CHECK_EQUAL(0u, (uintptr_t)&counter % CACHE_LINE_SIZE);
+	BOOST_CHECK_EQUAL(0u, (uintptr_t)&stats.chunksCreated % CACHE_LINE_SIZE);
+	BOOST_CHECK_EQUAL(0u, (uintptr_t)&stats.chunksEvicted % CACHE_LINE_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(TestHistogramPercentiles) {
+	HistogramStat histogram;
+	BOOST_CHECK_EQUAL(0.0, histogram.getPercentile(0.5));
+	for (unsigned i = 1; i <= 1000; ++i) {
+		histogram.record(1e-3 * i);
+	}
+	BOOST_CHECK_EQUAL(1000u, histogram.getCount());
+	BOOST_CHECK_CLOSE(0.500, histogram.getPercentile(0.50), 3.0);
+	BOOST_CHECK_CLOSE(0.950, histogram.getPercentile(0.95), 3.0);
+	BOOST_CHECK_CLOSE(0.990, histogram.getPercentile(0.99), 3.0);
+	BOOST_CHECK_CLOSE(1.000, histogram.getMax(), 1e-6);
+	BOOST_CHECK_CLOSE(1.000, histogram.getPercentile(1.0), 3.0);
+}
+
+BOOST_AUTO_TEST_CASE(TestHistogramOutlier) {
+	HistogramStat histogram;
+	for (unsigned i = 0; i < 99; ++i) {
+		histogram.record(0.010);
+	}
+	histogram.record(0.200);
+	BOOST_CHECK_CLOSE(0.010, histogram.getPercentile(0.50), 3.0);
+	BOOST_CHECK_CLOSE(0.010, histogram.getPercentile(0.99), 3.0);
+	BOOST_CHECK_CLOSE(0.200, histogram.getMax(), 1e-6);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,19 +3,101 @@
 #include "chunk.h"
 #include "chunkdata.h"
 #include "stats.h"
+#include "threading.h"
 
 #include <boost/bind.hpp>
 #include <boost/random.hpp>
 #include <boost/random/normal_distribution.hpp>
 
+#include <algorithm>
 #include <cmath>
 
-void TerrainGenerator::generateChunk(int3 const &position, RawChunkData &rawChunkData) const {
+Block TerrainGenerator::generateChunk(int3 const &position, PackedChunkData &chunkData) const {
 	TimerStat::Timed t = stats.chunkGenerationTime.timed();
-	doGenerateChunk(position, rawChunkData);
+	chunkData.clear();
+	Block const block = doGenerateChunk(position, chunkData);
+	if (block != INVALID_BLOCK) {
+		if (block != AIR_BLOCK) {
+			chunkData.fill(0, BLOCKS_PER_CHUNK, block);
+		}
+		stats.uniformChunksGenerated.increment();
+	}
 	stats.chunksGenerated.increment();
+	return block;
+}
+
+namespace {
+	PerThread<PackedChunkData> chunkDataScratch;
+}
+
+void TerrainGenerator::generateOctree(int3 const &position, Octree &octree) const {
+	PackedChunkData &chunkData = chunkDataScratch.get();
+	Block const block = generateChunk(position, chunkData);
+	if (block != INVALID_BLOCK) {
+		buildUniformOctree(block, octree);
+	} else {
+		buildOctree(chunkData, octree);
+	}
 }
 
+/* The height map of a chunk, along with the minimum and maximum height
+ * over every aligned square of power-of-two size, from single columns up to the whole chunk.
+ */
+class PerlinTerrainGenerator::HeightPyramid {
+
+	std::vector<unsigned> levelOffsets;
+	std::vector<float> mins;
+	std::vector<float> maxs;
+
+	public:
+
+		HeightPyramid(Perlin2D const &perlin2D, int3 const &pos)
+		:
+			levelOffsets(CHUNK_POWER + 1)
+		{
+			unsigned numCells = 0;
+			for (unsigned level = 0; level <= CHUNK_POWER; ++level) {
+				levelOffsets[level] = numCells;
+				numCells += (CHUNK_SIZE >> level) * (CHUNK_SIZE >> level);
+			}
+			mins.resize(numCells);
+			maxs.resize(numCells);
+
+			for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
+				for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
+					vec2 p(blockCenter(pos + int3(x, y, 0)));
+					mins[x + CHUNK_SIZE * y] = maxs[x + CHUNK_SIZE * y] = perlin2D(p);
+				}
+			}
+			for (unsigned level = 1; level <= CHUNK_POWER; ++level) {
+				unsigned const size = CHUNK_SIZE >> level;
+				unsigned const *const offsets = &levelOffsets[level - 1];
+				for (unsigned y = 0; y < size; ++y) {
+					for (unsigned x = 0; x < size; ++x) {
+						unsigned const a = offsets[0] + 2 * x + 4 * size * y;
+						unsigned const b = a + 2 * size;
+						unsigned const i = offsets[1] + x + size * y;
+						mins[i] = std::min(std::min(mins[a], mins[a + 1]), std::min(mins[b], mins[b + 1]));
+						maxs[i] = std::max(std::max(maxs[a], maxs[a + 1]), std::max(maxs[b], maxs[b + 1]));
+					}
+				}
+			}
+		}
+
+		float getHeight(unsigned x, unsigned y) const {
+			return mins[x + CHUNK_SIZE * y];
+		}
+
+		// The square must be aligned to its size, which must be a power of two.
+		void getRange(unsigned size, unsigned x, unsigned y, float *minHeight, float *maxHeight) const {
+			unsigned const level = __builtin_ctz(size);
+			unsigned const i = levelOffsets[level] + (x >> level) + (CHUNK_SIZE >> level) * (y >> level);
+			*minHeight = mins[i];
+			*maxHeight = maxs[i];
+		}
+
+};
+
 // TODO don't reuse seed
 PerlinTerrainGenerator::PerlinTerrainGenerator(unsigned size, unsigned seed)
 :
@@ -50,51 +132,156 @@ Octaves PerlinTerrainGenerator::buildOctaves3D(unsigned seed) const {
 	return octaves;
 }
 
-void PerlinTerrainGenerator::doGenerateChunk(int3 const &pos, RawChunkData &rawChunkData) const {
-	std::vector<float> heights(CHUNK_SIZE * CHUNK_SIZE);
-	for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
-		for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-			vec2 p(blockCenter(pos + int3(x, y, 0)));
-			heights[x + CHUNK_SIZE * y] = perlin2D(p);
-		}
+/* A block is stone if it is below the height map,
+ * but within amplitude3D of the surface, 3D noise decides.
+ * So a region whose blocks are all above the highest point is air,
+ * and one whose blocks are all further than amplitude3D below the lowest point is stone.
+ */
+Block PerlinTerrainGenerator::classifyRegion(float minZ, float maxZ, float minHeight, float maxHeight) const {
+	if (minZ - maxHeight > 0) {
+		return AIR_BLOCK;
+	}
+	if (maxZ - minHeight < -perlin3D.getAmplitude()) {
+		return STONE_BLOCK;
+	}
+	return INVALID_BLOCK;
+}
+
+inline bool PerlinTerrainGenerator::isStone(int3 const &position, float height) const {
+	vec3 const center = blockCenter(position);
+	float h = center.z - height;
+	if (h >= -perlin3D.getAmplitude() && h <= 0) {
+		h += perlin3D(center);
 	}
-	float const amplitude3D = perlin3D.getAmplitude();
-	Block *p = rawChunkData.raw();
+	return h < 0;
+}
+
+Block PerlinTerrainGenerator::doGenerateChunk(int3 const &pos, PackedChunkData &chunkData) const {
+	float const minZ = blockCenter(pos).z;
+	float const maxZ = blockCenter(pos + int3(0, 0, CHUNK_SIZE - 1)).z;
+
+	// Noise values lie within the amplitude; allow a block for rounding errors.
+	float const amplitude2D = perlin2D.getAmplitude() + 1.0f;
+	Block block = classifyRegion(minZ, maxZ, -amplitude2D, amplitude2D);
+	if (block != INVALID_BLOCK) {
+		return block;
+	}
+
+	HeightPyramid const heights(perlin2D, pos);
+	float minHeight;
+	float maxHeight;
+	heights.getRange(CHUNK_SIZE, 0, 0, &minHeight, &maxHeight);
+	block = classifyRegion(minZ, maxZ, minHeight, maxHeight);
+	if (block != INVALID_BLOCK) {
+		return block;
+	}
+
+	// The chunk starts out as all air, so only stone needs to be written.
+	unsigned const stone = chunkData.encode(STONE_BLOCK);
+	unsigned i = 0;
 	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
 		for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
 			for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
-				vec3 center = blockCenter(pos + int3(x, y, z));
-				Block block = AIR_BLOCK;
-				float h = center.z - heights[x + CHUNK_SIZE * y];
-				if (h >= -amplitude3D && h <= 0) {
-					h += perlin3D(center);
+				if (isStone(pos + int3(x, y, z), heights.getHeight(x, y))) {
+					chunkData.setCode(i, stone);
 				}
-				if (h < 0) {
-					block = STONE_BLOCK;
-				}
-				*p = block;
-				++p;
+				++i;
 			}
 		}
 	}
+	return INVALID_BLOCK;
 }
 
-void SineTerrainGenerator::doGenerateChunk(int3 const &pos, RawChunkData &rawChunkData) const {
+/* Returns the node for the given region. If it is mixed, its children and their subtrees are appended to nodes,
+ * in the same layout that buildOctree produces.
+ */
+OctreeNode PerlinTerrainGenerator::generateNode(int3 const &pos, HeightPyramid const &heights, unsigned size, int3 const &base, OctreeNodes &nodes) const {
+	if (size == 1) {
+		return OctreeNode(isStone(pos + base, heights.getHeight(base.x, base.y)) ? STONE_BLOCK : AIR_BLOCK);
+	}
+
+	float minHeight;
+	float maxHeight;
+	heights.getRange(size, base.x, base.y, &minHeight, &maxHeight);
+	Block const block = classifyRegion(
+			blockCenter(pos + base).z,
+			blockCenter(pos + base + int3(0, 0, size - 1)).z,
+			minHeight, maxHeight);
+	if (block != INVALID_BLOCK) {
+		return OctreeNode(block);
+	}
+
+	// Reserve a slot for each child; their subtrees are appended after these.
+	unsigned const s = size / 2;
+	unsigned const firstChild = nodes.size();
+	nodes.resize(firstChild + 8);
+	for (unsigned i = 0; i < 8; ++i) {
+		int3 const childBase = base + int3((i & 1) ? s : 0, (i & 2) ? s : 0, (i & 4) ? s : 0);
+		OctreeNode const child = generateNode(pos, heights, s, childBase, nodes);
+		nodes[firstChild + i] = child;
+	}
+
+	// The height bounds are conservative, so the region may turn out to be uniform after all.
+	return mergeChildren(firstChild, nodes);
+}
+
+void PerlinTerrainGenerator::generateOctree(int3 const &pos, Octree &octree) const {
+	TimerStat::Timed t = stats.chunkGenerationTime.timed();
+	octree = Octree();
+	OctreeNodes &nodes = octree.getNodes();
+
+	float const amplitude2D = perlin2D.getAmplitude() + 1.0f;
+	Block const block = classifyRegion(
+			blockCenter(pos).z,
+			blockCenter(pos + int3(0, 0, CHUNK_SIZE - 1)).z,
+			-amplitude2D, amplitude2D);
+	if (block != INVALID_BLOCK) {
+		buildUniformOctree(block, octree);
+		stats.uniformChunksGenerated.increment();
+	} else {
+		HeightPyramid const heights(perlin2D, pos);
+		// The root goes first; its children are appended after it.
+		nodes.push_back(OctreeNode());
+		OctreeNode const root = generateNode(pos, heights, CHUNK_SIZE, int3(0, 0, 0), nodes);
+		if (root.block == AIR_BLOCK) {
+			nodes.clear();
+		} else {
+			nodes[0] = root;
+		}
+		if (root.block != INVALID_BLOCK) {
+			stats.uniformChunksGenerated.increment();
+		}
+		octree.shrinkToFit();
+	}
+
+	stats.chunksGenerated.increment();
+	stats.octreesGenerated.increment();
+	stats.octreeNodes.increment(octree.getNumNodes());
+	stats.octreeBytes.increment(octree.getSizeInBytes());
+}
+
+Block SineTerrainGenerator::doGenerateChunk(int3 const &pos, PackedChunkData &chunkData) const {
 	float const amplitude = 32.0f;
 	float const period = 256.0f;
 	float const omega = 2 * M_PI / period;
-	Block *p = rawChunkData.raw();
+	if (blockCenter(pos).z > 2 * amplitude + 1) {
+		return AIR_BLOCK;
+	}
+	if (blockCenter(pos + int3(0, 0, CHUNK_SIZE - 1)).z < -2 * amplitude - 1) {
+		return STONE_BLOCK;
+	}
+	unsigned const stone = chunkData.encode(STONE_BLOCK);
+	unsigned i = 0;
 	for (unsigned z = 0; z < CHUNK_SIZE; ++z) {
 		for (unsigned y = 0; y < CHUNK_SIZE; ++y) {
 			for (unsigned x = 0; x < CHUNK_SIZE; ++x) {
 				vec3 c = blockCenter(pos + int3(x, y, z));
-				Block block = AIR_BLOCK;
 				if (c.z < amplitude * (sinf(omega * c.x) + sinf(omega * c.y))) {
-					block = STONE_BLOCK;
+					chunkData.setCode(i, stone);
 				}
-				*p = block;
-				++p;
+				++i;
 			}
 		}
 	}
+	return INVALID_BLOCK;
 }
@@ -3,6 +3,7 @@
 
 #include "chunkdata.h"
 #include "maths.h"
+#include "octree.h"
 #include "perlin.h"
 
 #include <boost/noncopyable.hpp>
@@ -13,11 +14,22 @@ class TerrainGenerator {
 
 	public:
 
-		void generateChunk(int3 const &position, RawChunkData &rawChunkData) const;
+		/* Fills chunkData, and returns the block that makes up the entire chunk,
+		 * or INVALID_BLOCK if it is not uniform.
+		 */
+		Block generateChunk(int3 const &position, PackedChunkData &chunkData) const;
+
+		/* Generates the chunk straight into an octree.
+		 * By default, this generates the blocks into per-thread scratch space and builds the octree from those.
+		 */
+		virtual void generateOctree(int3 const &position, Octree &octree) const;
 
 	private:
 
-		virtual void doGenerateChunk(int3 const &pos, RawChunkData &rawData) const = 0;
+		/* May return a uniform block without touching chunkData,
+		 * if it can tell that the chunk consists of only that block.
+		 */
+		virtual Block doGenerateChunk(int3 const &pos, PackedChunkData &chunkData) const = 0;
 
 };
 
@@ -27,6 +39,8 @@ class PerlinTerrainGenerator
 	public TerrainGenerator
 {
 
+	class HeightPyramid;
+
 	Perlin2D perlin2D;
 	Perlin3D perlin3D;
 
@@ -34,12 +48,22 @@ class PerlinTerrainGenerator
 
 		PerlinTerrainGenerator(unsigned size, unsigned seed);
 
+		/* Builds the octree top-down, using the range of the height map above each node
+		 * to find uniform nodes without sampling their blocks.
+		 * The result is identical to that of buildOctree on the generated blocks.
+		 */
+		virtual void generateOctree(int3 const &position, Octree &octree) const;
+
 	private:
 
 		Octaves buildOctaves2D(unsigned seed) const;
 		Octaves buildOctaves3D(unsigned seed) const;
 
-		virtual void doGenerateChunk(int3 const &pos, RawChunkData &rawChunkData) const;
+		Block classifyRegion(float minZ, float maxZ, float minHeight, float maxHeight) const;
+		bool isStone(int3 const &position, float height) const;
+		OctreeNode generateNode(int3 const &pos, HeightPyramid const &heights, unsigned size, int3 const &base, OctreeNodes &nodes) const;
+
+		virtual Block doGenerateChunk(int3 const &pos, PackedChunkData &chunkData) const;
 
 };
 
@@ -50,7 +74,7 @@ class SineTerrainGenerator
 
 	private:
 
-		virtual void doGenerateChunk(int3 const &pos, RawChunkData &rawChunkData) const;
+		virtual Block doGenerateChunk(int3 const &pos, PackedChunkData &chunkData) const;
 
 };
 
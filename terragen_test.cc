@@ -0,0 +1,52 @@
+#include "terragen.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TerraGenTest)
+
+BOOST_AUTO_TEST_CASE(TestUniformChunks) {
+	PerlinTerrainGenerator generator(32, 1);
+	PackedChunkData data;
+	BOOST_REQUIRE_EQUAL((Block)AIR_BLOCK, generator.generateChunk(chunkPositionFromIndex(int3(0, 0, 1)), data));
+	BOOST_REQUIRE_EQUAL((Block)STONE_BLOCK, generator.generateChunk(chunkPositionFromIndex(int3(0, 0, -3)), data));
+	for (int z = -3; z <= 1; ++z) {
+		Block const block = generator.generateChunk(chunkPositionFromIndex(int3(0, 0, z)), data);
+		if (block != INVALID_BLOCK) {
+			BOOST_REQUIRE(data.isUniformRun(0, BLOCKS_PER_CHUNK, 0));
+			BOOST_REQUIRE_EQUAL(block, data.get(0));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestMixedChunk) {
+	PerlinTerrainGenerator generator(32, 1);
+	PackedChunkData data;
+	BOOST_REQUIRE_EQUAL((Block)INVALID_BLOCK, generator.generateChunk(chunkPositionFromIndex(int3(0, 0, 0)), data));
+	BOOST_REQUIRE(!data.isUniformRun(0, BLOCKS_PER_CHUNK, 0));
+}
+
+BOOST_AUTO_TEST_CASE(TestGenerateOctreeMatchesBuild) {
+	PerlinTerrainGenerator generator(32, 1);
+	PackedChunkData data;
+	for (int z = -2; z <= 1; ++z) {
+		for (int x = 0; x <= 1; ++x) {
+			int3 const position = chunkPositionFromIndex(int3(x, -x, z));
+			Octree built;
+			Block const block = generator.generateChunk(position, data);
+			if (block != INVALID_BLOCK) {
+				buildUniformOctree(block, built);
+			} else {
+				buildOctree(data, built);
+			}
+			Octree generated;
+			generator.generateOctree(position, generated);
+			BOOST_REQUIRE_EQUAL(built.getNumNodes(), generated.getNumNodes());
+			for (unsigned i = 0; i < built.getNumNodes(); ++i) {
+				BOOST_REQUIRE_EQUAL(built.getNode(i).block, generated.getNode(i).block);
+				BOOST_REQUIRE_EQUAL(built.getNode(i).children, generated.getNode(i).children);
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include "space.h"
 #include "stats.h"
 #include "terragen.h"
+#include "trace.h"
 
 #include <boost/assert.hpp>
 
@@ -27,9 +28,12 @@ void Terrain::addViewSphere(WeakConstViewSpherePtr viewSphere) {
 void Terrain::update(float dt) {
 	chunkManager.sow();
 	chunkManager.reap();
+	chunkManager.evict();
 }
 
 void Terrain::render(Camera const &camera, Lighting const &lighting) {
+	TraceSpan span("Terrain::render");
+
 	GLAtmosphere const &atmosphere = lighting.getAtmosphere();
 	AtmosParams const &params = atmosphere.getParams();
 	Sun const &sun = lighting.getSun();
@@ -54,43 +58,30 @@ void Terrain::render(Camera const &camera, Lighting const &lighting) {
 	bindTexture(GL_TEXTURE_RECTANGLE, atmosphere.getTotalTransmittanceTexture());
 	shaderProgram.setUniform("totalTransmittanceSampler", 0);
 
-	int3 center = chunkIndexFromPoint(camera.getPosition());
-	int radius = flags.viewDistance / CHUNK_SIZE;
-	for (int z = -radius; z <= radius; ++z) {
-		for (int y = -radius; y <= radius; ++y) {
-			for (int x = -radius; x <= radius; ++x) {
-				// TODO sphere check
-				int3 const index = center + int3(x, y, z);
-				// TODO do this properly by emulating the matrix stack
-				shaderProgram.setUniform("vertexOffset", chunkMin(index));
-				renderChunk(camera, index);
-			}
+	// Only look at chunks that have data; this neither creates chunks nor touches the ChunkMap.
+	GLUniform const vertexOffset = shaderProgram.getUniform("vertexOffset");
+	vec3 const center = camera.getPosition();
+	float const maxDistance = flags.viewDistance + CHUNK_RADIUS;
+	std::vector<ChunkPtr> const &chunks = chunkManager.getLoadedChunks();
+	for (unsigned i = 0; i < chunks.size(); ++i) {
+		Chunk &chunk = *chunks[i];
+		int3 const index = chunk.getIndex();
+		if (length(chunkCenter(index) - center) > maxDistance) {
+			continue;
 		}
+		// TODO do this properly by emulating the matrix stack
+		uniform(vertexOffset, chunkMin(index));
+		renderChunk(camera, chunk);
 	}
 }
 
-// TODO this is currently unused
-unsigned Terrain::computeMaxNumChunks() const {
-	if (flags.maxNumChunks != 0) {
-		return flags.maxNumChunks;
-	}
-	unsigned radius = flags.viewDistance / CHUNK_SIZE;
-	unsigned size = 2 * radius + 1;
-	return size * size * size;
-}
-
-void Terrain::renderChunk(Camera const &camera, int3 const &index) {
-	// TODO avoid creating 'em (change [] semantics?)
-	ChunkPtr chunk = chunkMap[index];
-	if (!chunk) {
-		return;
-	}
+void Terrain::renderChunk(Camera const &camera, Chunk &chunk) {
 	stats.chunksConsidered.increment();
-	if (chunk->getState() < Chunk::TESSELATED) {
+	if (chunk.getState() < Chunk::TESSELATED) {
 		stats.chunksSkipped.increment();
 	} else {
-		if (camera.isSphereInView(chunkCenter(index), CHUNK_RADIUS)) {
-			chunk->render();
+		if (camera.isSphereInView(chunkCenter(chunk.getIndex()), CHUNK_RADIUS)) {
+			chunk.render();
 		} else {
 			stats.chunksCulled.increment();
 		}
@@ -35,8 +35,7 @@ class Terrain
 
 	private:
 
-		unsigned computeMaxNumChunks() const;
-		void renderChunk(Camera const &camera, int3 const &index);
+		void renderChunk(Camera const &camera, Chunk &chunk);
 
 };
 
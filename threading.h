@@ -22,4 +22,28 @@ class Semaphore
 
 };
 
+/* Holds one lazily constructed T per thread, which lives until the thread exits.
+ * Meant for large scratch buffers, and objects that own them, that would otherwise be set up anew for every job.
+ * For the workers of a ThreadPool, that means they are destroyed along with the pool.
+ */
+template<typename T>
+class PerThread
+:
+	boost::noncopyable
+{
+	boost::thread_specific_ptr<T> instance;
+
+	public:
+
+		T &get() {
+			T *t = instance.get();
+			if (!t) {
+				t = new T();
+				instance.reset(t);
+			}
+			return *t;
+		}
+
+};
+
 #endif
@@ -1,5 +1,8 @@
 #include "threadpool.h"
 
+#include <algorithm>
+#include <limits>
+
 WorkQueue::WorkQueue(unsigned maxSize)
 :
 	maxSize(maxSize),
@@ -72,11 +75,18 @@ void WorkQueue::doPost(Worker worker) {
 ThreadPool::ThreadPool(unsigned maxQueueSize, unsigned numThreads)
 :
 	numThreads(numThreads == 0 ? defaultNumThreads() : numThreads),
-	queue(maxQueueSize),
-	threads(new boost::scoped_ptr<boost::thread>[numThreads])
+	maxQueueSize(maxQueueSize),
+	queueSize(0),
+	nextDeque(0),
+	deques(new boost::scoped_ptr<WorkerDeque>[this->numThreads]),
+	numSleeping(0),
+	threads(new boost::scoped_ptr<boost::thread>[this->numThreads])
 {
-	for (unsigned i = 0; i < numThreads; ++i) {
-		threads[i].reset(new boost::thread(boost::bind(&ThreadPool::loop, this)));
+	for (unsigned i = 0; i < this->numThreads; ++i) {
+		deques[i].reset(new WorkerDeque());
+	}
+	for (unsigned i = 0; i < this->numThreads; ++i) {
+		threads[i].reset(new boost::thread(boost::bind(&ThreadPool::loop, this, i)));
 	}
 }
 
@@ -84,26 +94,36 @@ ThreadPool::~ThreadPool() {
 	for (unsigned i = 0; i < numThreads; ++i) {
 		threads[i]->interrupt();
 	}
-	// Do not delete the queue until all threads have finished.
+	// Do not delete the deques until all threads have finished.
 	for (unsigned i = 0; i < numThreads; ++i) {
 		threads[i]->join();
 	}
 }
 
-void ThreadPool::enqueue(Worker worker) {
-	queue.post(worker);
+void ThreadPool::enqueue(Worker worker, Prioritizer prioritizer, Worker canceller) {
+	if (!tryReserve()) {
+		boost::unique_lock<boost::mutex> lock(sleepMutex);
+		while (!tryReserve()) {
+			notFull.wait(lock);
+		}
+	}
+	push(Job(worker, prioritizer, canceller));
 }
 
-bool ThreadPool::tryEnqueue(Worker worker) {
-	return queue.tryPost(worker);
+bool ThreadPool::tryEnqueue(Worker worker, Prioritizer prioritizer, Worker canceller) {
+	if (!tryReserve()) {
+		return false;
+	}
+	push(Job(worker, prioritizer, canceller));
+	return true;
 }
 
 unsigned ThreadPool::getQueueSize() const {
-	return queue.getSize();
+	return queueSize.load(boost::memory_order_relaxed);
 }
 
 unsigned ThreadPool::getMaxQueueSize() const {
-	return queue.getMaxSize();
+	return maxQueueSize;
 }
 
 unsigned ThreadPool::defaultNumThreads() {
@@ -114,8 +134,114 @@ unsigned ThreadPool::defaultNumThreads() {
 	return numThreads;
 }
 
-void ThreadPool::loop() {
+bool ThreadPool::tryReserve() {
+	unsigned size = queueSize.load(boost::memory_order_relaxed);
+	do {
+		if (maxQueueSize != 0 && size >= maxQueueSize) {
+			return false;
+		}
+	} while (!queueSize.compare_exchange_weak(size, size + 1));
+	return true;
+}
+
+void ThreadPool::prioritize(Job &job) {
+	if (job.priority == -std::numeric_limits<float>::infinity()) {
+		return;
+	}
+	job.priority = job.prioritizer ? job.prioritizer() : 0.0f;
+	if (job.priority == std::numeric_limits<float>::infinity()) {
+		job.worker = job.canceller;
+		job.priority = -std::numeric_limits<float>::infinity();
+	}
+}
+
+void ThreadPool::reprioritize() {
+	for (unsigned i = 0; i < numThreads; ++i) {
+		WorkerDeque &workerDeque = *deques[i];
+		// The deques are short and the prioritizers cheap, so the owner is not held up for long.
+		boost::unique_lock<boost::mutex> lock(workerDeque.mutex);
+		std::deque<Job> &deque = workerDeque.deque;
+		for (std::deque<Job>::iterator j = deque.begin(); j != deque.end(); ++j) {
+			prioritize(*j);
+		}
+		std::stable_sort(deque.begin(), deque.end());
+	}
+}
+
+void ThreadPool::push(Job job) {
+	prioritize(job);
+	// The sizes are read without locking, so they may be slightly stale; that only skews the balance a little.
+	unsigned target = nextDeque.fetch_add(1, boost::memory_order_relaxed) % numThreads;
+	for (unsigned i = 1; i < numThreads; ++i) {
+		unsigned const candidate = (target + i) % numThreads;
+		if (deques[candidate]->size.load(boost::memory_order_relaxed) < deques[target]->size.load(boost::memory_order_relaxed)) {
+			target = candidate;
+		}
+	}
+	WorkerDeque &workerDeque = *deques[target];
+	{
+		boost::unique_lock<boost::mutex> lock(workerDeque.mutex);
+		std::deque<Job> &deque = workerDeque.deque;
+		deque.insert(std::upper_bound(deque.begin(), deque.end(), job), job);
+		workerDeque.size.store(deque.size(), boost::memory_order_relaxed);
+	}
+	// Pairs with the sequentially consistent increment of numSleeping in loop():
+	// either we see the sleeper, or the sleeper sees our job.
+	if (numSleeping.load() > 0) {
+		boost::unique_lock<boost::mutex> lock(sleepMutex);
+		wakeUp.notify_one();
+	}
+}
+
+bool ThreadPool::tryTake(unsigned workerIndex, Job &job) {
+	// Our own deque first; the others are only looked at if it is empty.
+	for (unsigned i = 0; i < numThreads; ++i) {
+		if (tryTakeFrom(*deques[(workerIndex + i) % numThreads], job)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::tryTakeFrom(WorkerDeque &workerDeque, Job &job) {
+	if (workerDeque.size.load(boost::memory_order_relaxed) == 0) {
+		// Don't bother taking the lock of an empty deque. A job that is just being pushed is found
+		// on the next trip around the loop, because queueSize keeps the worker from sleeping.
+		return false;
+	}
+	boost::unique_lock<boost::mutex> lock(workerDeque.mutex);
+	std::deque<Job> &deque = workerDeque.deque;
+	if (deque.empty()) {
+		return false;
+	}
+	std::swap(job, deque.front());
+	deque.pop_front();
+	workerDeque.size.store(deque.size(), boost::memory_order_relaxed);
+	return true;
+}
+
+void ThreadPool::loop(unsigned workerIndex) {
+	Job job;
 	while (true) {
-		queue.runOne();
+		boost::this_thread::interruption_point();
+		if (tryTake(workerIndex, job)) {
+			if (queueSize.fetch_sub(1) == maxQueueSize) {
+				boost::unique_lock<boost::mutex> lock(sleepMutex);
+				notFull.notify_all();
+			}
+			if (job.worker) {
+				job.worker();
+			}
+			job = Job();
+		} else {
+			boost::unique_lock<boost::mutex> lock(sleepMutex);
+			numSleeping.fetch_add(1);
+			// The job count is bumped before a job is pushed, so we may wake up before it is there.
+			// That only costs another trip around the loop.
+			while (queueSize.load() == 0) {
+				wakeUp.wait(lock);
+			}
+			numSleeping.fetch_sub(1);
+		}
 	}
 }
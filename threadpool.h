@@ -3,7 +3,9 @@
 
 #include "threading.h"
 
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -51,25 +53,78 @@ class WorkQueue
 
 };
 
+/* A pool of worker threads, each of which has its own deque of jobs.
+ * A posted job goes to the deque that holds the fewest jobs. A worker takes jobs from its own deque,
+ * and only when that is empty does it steal from the front of the others', so each lock is normally
+ * shared between its owner and the poster alone.
+ * Jobs may come with a prioritizer. Lower is better; jobs without one have priority zero.
+ * Prioritizers only run on the posting thread: when a job is posted, and again for all waiting jobs
+ * whenever reprioritize() is called. Each deque is kept sorted by these cached priorities, in posting
+ * order among equals, so taking a job is just popping the front.
+ * If the prioritizer returns infinity, the job is dropped, and its canceller (if any) is run instead;
+ * such jobs go to the front, so that they free up their slot quickly.
+ * Idle workers sleep on a condition variable, which is only touched if someone is asleep.
+ */
 class ThreadPool
 :
 	boost::noncopyable
 {
-	unsigned const numThreads;
+	public:
 
-	WorkQueue queue;
+		typedef WorkQueue::Worker Worker;
+		typedef boost::function<float(void)> Prioritizer;
 
-	boost::scoped_array<boost::scoped_ptr<boost::thread> > const threads;
+	private:
 
-	public:
+		struct Job {
+			Worker worker;
+			Prioritizer prioritizer;
+			Worker canceller;
+			// As of the last call to the prioritizer; minus infinity once the job is cancelled.
+			float priority;
+			Job() : priority(0.0f) { }
+			Job(Worker worker, Prioritizer prioritizer, Worker canceller)
+			: worker(worker), prioritizer(prioritizer), canceller(canceller), priority(0.0f) { }
+			bool operator<(Job const &other) const { return priority < other.priority; }
+		};
+
+		struct WorkerDeque
+		:
+			boost::noncopyable
+		{
+			boost::mutex mutex;
+			std::deque<Job> deque;
+			// The length of the deque, for the poster to read without taking the lock.
+			boost::atomic<unsigned> size;
+			WorkerDeque() : size(0) { }
+		};
+
+		unsigned const numThreads;
+		unsigned const maxQueueSize;
+
+		// Jobs that have been posted but not yet taken, including those that are just being pushed.
+		boost::atomic<unsigned> queueSize;
+		// Where the poster starts looking for the shortest deque, so that ties are dealt out round-robin.
+		boost::atomic<unsigned> nextDeque;
+		boost::scoped_array<boost::scoped_ptr<WorkerDeque> > const deques;
+
+		boost::atomic<unsigned> numSleeping;
+		boost::mutex sleepMutex;
+		boost::condition_variable wakeUp;
+		boost::condition_variable notFull;
+
+		boost::scoped_array<boost::scoped_ptr<boost::thread> > const threads;
 
-		typedef WorkQueue::Worker Worker;
+	public:
 
 		ThreadPool(unsigned maxQueueSize, unsigned numThreads = defaultNumThreads());
 		~ThreadPool();
 
-		void enqueue(Worker worker);
-		bool tryEnqueue(Worker worker);
+		void enqueue(Worker worker, Prioritizer prioritizer = Prioritizer(), Worker canceller = Worker());
+		bool tryEnqueue(Worker worker, Prioritizer prioritizer = Prioritizer(), Worker canceller = Worker());
+
+		// Calls the prioritizers of all waiting jobs again, and reorders them accordingly.
+		void reprioritize();
 
 		unsigned getQueueSize() const;
 		unsigned getMaxQueueSize() const;
@@ -78,7 +133,13 @@ class ThreadPool
 
 	private:
 
-		void loop();
+		bool tryReserve();
+		static void prioritize(Job &job);
+		void push(Job job);
+		bool tryTake(unsigned workerIndex, Job &job);
+		bool tryTakeFrom(WorkerDeque &workerDeque, Job &job);
+
+		void loop(unsigned workerIndex);
 
 };
 
@@ -0,0 +1,174 @@
+#include "threadpool.h"
+
+#include <boost/atomic.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <limits>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(ThreadPoolTest)
+
+namespace {
+	void increment(boost::atomic<unsigned> *counter) {
+		counter->fetch_add(1);
+	}
+
+	void waitFor(boost::atomic<unsigned> const *counter, unsigned value) {
+		while (counter->load() < value) {
+			boost::this_thread::yield();
+		}
+	}
+
+	void waitUntilOpen(boost::atomic<bool> const *gate, boost::atomic<unsigned> *counter) {
+		while (!gate->load()) {
+			boost::this_thread::yield();
+		}
+		counter->fetch_add(1);
+	}
+
+	void startAndWaitUntilOpen(boost::atomic<unsigned> *started, boost::atomic<bool> const *gate, boost::atomic<unsigned> *counter) {
+		started->fetch_add(1);
+		waitUntilOpen(gate, counter);
+	}
+
+	void record(std::vector<int> *order, int value, boost::atomic<unsigned> *counter) {
+		order->push_back(value);
+		counter->fetch_add(1);
+	}
+
+	float constant(float value) {
+		return value;
+	}
+
+	float variable(float const *value) {
+		return *value;
+	}
+}
+
+BOOST_AUTO_TEST_CASE(TestRunsAllJobs) {
+	boost::atomic<unsigned> counter(0);
+	unsigned const n = 10000;
+	{
+		ThreadPool threadPool(16, 4);
+		for (unsigned i = 0; i < n; ++i) {
+			threadPool.enqueue(boost::bind(&increment, &counter));
+		}
+		waitFor(&counter, n);
+		BOOST_CHECK_EQUAL(0u, threadPool.getQueueSize());
+	}
+	BOOST_CHECK_EQUAL(n, counter.load());
+}
+
+BOOST_AUTO_TEST_CASE(TestTryEnqueueRespectsMaxQueueSize) {
+	boost::atomic<bool> gate(false);
+	boost::atomic<unsigned> counter(0);
+	ThreadPool threadPool(2, 1);
+
+	// Occupy the only worker, then fill up the queue behind it.
+	threadPool.enqueue(boost::bind(&waitUntilOpen, &gate, &counter));
+	while (threadPool.getQueueSize() > 0) {
+		boost::this_thread::yield();
+	}
+	BOOST_CHECK(threadPool.tryEnqueue(boost::bind(&increment, &counter)));
+	BOOST_CHECK(threadPool.tryEnqueue(boost::bind(&increment, &counter)));
+	BOOST_CHECK(!threadPool.tryEnqueue(boost::bind(&increment, &counter)));
+	BOOST_CHECK_EQUAL(2u, threadPool.getQueueSize());
+
+	gate.store(true);
+	waitFor(&counter, 3);
+	BOOST_CHECK_EQUAL(0u, threadPool.getQueueSize());
+}
+
+BOOST_AUTO_TEST_CASE(TestPrioritiesAndCancellation) {
+	boost::atomic<bool> gate(false);
+	boost::atomic<unsigned> counter(0);
+	std::vector<int> order;
+	ThreadPool threadPool(8, 1);
+
+	threadPool.enqueue(boost::bind(&waitUntilOpen, &gate, &counter));
+	while (threadPool.getQueueSize() > 0) {
+		boost::this_thread::yield();
+	}
+	threadPool.enqueue(boost::bind(&record, &order, 3, &counter), boost::bind(&constant, 3.0f));
+	threadPool.enqueue(boost::bind(&record, &order, 1, &counter), boost::bind(&constant, 1.0f));
+	threadPool.enqueue(
+			boost::bind(&record, &order, 0, &counter),
+			boost::bind(&constant, std::numeric_limits<float>::infinity()),
+			boost::bind(&record, &order, -1, &counter));
+	threadPool.enqueue(boost::bind(&record, &order, 2, &counter), boost::bind(&constant, 2.0f));
+
+	gate.store(true);
+	waitFor(&counter, 5);
+	BOOST_REQUIRE_EQUAL(4u, order.size());
+	BOOST_CHECK_EQUAL(-1, order[0]);
+	BOOST_CHECK_EQUAL(1, order[1]);
+	BOOST_CHECK_EQUAL(2, order[2]);
+	BOOST_CHECK_EQUAL(3, order[3]);
+}
+
+BOOST_AUTO_TEST_CASE(TestReprioritize) {
+	boost::atomic<bool> gate(false);
+	boost::atomic<unsigned> counter(0);
+	std::vector<int> order;
+	ThreadPool threadPool(8, 1);
+
+	threadPool.enqueue(boost::bind(&waitUntilOpen, &gate, &counter));
+	while (threadPool.getQueueSize() > 0) {
+		boost::this_thread::yield();
+	}
+	float priorities[] = { 1.0f, 2.0f, 3.0f, 4.0f };
+	for (int i = 0; i < 4; ++i) {
+		threadPool.enqueue(
+				boost::bind(&record, &order, i, &counter),
+				boost::bind(&variable, &priorities[i]),
+				boost::bind(&record, &order, -1 - i, &counter));
+	}
+
+	// The prioritizers are only called again by reprioritize().
+	priorities[0] = 3.5f;
+	priorities[1] = std::numeric_limits<float>::infinity();
+	priorities[3] = 0.5f;
+	threadPool.reprioritize();
+	// Once cancelled, a job stays cancelled.
+	priorities[1] = 0.0f;
+	threadPool.reprioritize();
+
+	gate.store(true);
+	waitFor(&counter, 5);
+	BOOST_REQUIRE_EQUAL(4u, order.size());
+	BOOST_CHECK_EQUAL(-2, order[0]);
+	BOOST_CHECK_EQUAL(3, order[1]);
+	BOOST_CHECK_EQUAL(2, order[2]);
+	BOOST_CHECK_EQUAL(0, order[3]);
+}
+
+BOOST_AUTO_TEST_CASE(TestIdleWorkerSteals) {
+	unsigned const numThreads = 4;
+	boost::atomic<bool> busyGate(false);
+	boost::atomic<bool> freeGate(false);
+	boost::atomic<unsigned> started(0);
+	boost::atomic<unsigned> counter(0);
+	ThreadPool threadPool(16, numThreads);
+
+	// Occupy all workers, so that the jobs below get spread over all deques.
+	// Then let a single one go, which has to steal the jobs in the other deques.
+	for (unsigned i = 0; i < numThreads - 1; ++i) {
+		threadPool.enqueue(boost::bind(&startAndWaitUntilOpen, &started, &busyGate, &counter));
+	}
+	threadPool.enqueue(boost::bind(&startAndWaitUntilOpen, &started, &freeGate, &counter));
+	waitFor(&started, numThreads);
+
+	unsigned const numJobs = 2 * numThreads;
+	for (unsigned i = 0; i < numJobs; ++i) {
+		threadPool.enqueue(boost::bind(&increment, &counter));
+	}
+
+	freeGate.store(true);
+	waitFor(&counter, numJobs + 1);
+	BOOST_CHECK_EQUAL(0u, threadPool.getQueueSize());
+	busyGate.store(true);
+	waitFor(&counter, numJobs + numThreads);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,124 @@
+#include "trace.h"
+
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread.hpp>
+
+#include <ctime>
+#include <fstream>
+#include <vector>
+
+namespace {
+
+	struct TraceEvent {
+		char const *name;
+		bool hasChunkIndex;
+		int3 chunkIndex;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	struct TraceBuffer
+	:
+		boost::noncopyable
+	{
+		unsigned const threadId;
+		// Only contended while the trace is being written.
+		boost::mutex mutex;
+		std::vector<TraceEvent> events;
+		TraceBuffer(unsigned threadId) : threadId(threadId) { }
+	};
+
+	bool tracing = false;
+	uint64_t traceStart;
+
+	boost::mutex buffersMutex;
+	boost::ptr_vector<TraceBuffer> buffers;
+
+	__thread TraceBuffer *currentBuffer = 0;
+
+	uint64_t now() {
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+	}
+
+	TraceBuffer &getCurrentBuffer() {
+		if (!currentBuffer) {
+			boost::unique_lock<boost::mutex> lock(buffersMutex);
+			buffers.push_back(new TraceBuffer(buffers.size() + 1));
+			currentBuffer = &buffers.back();
+		}
+		return *currentBuffer;
+	}
+
+}
+
+bool isTracing() {
+	return tracing;
+}
+
+void startTracing() {
+	traceStart = now();
+	tracing = true;
+}
+
+bool writeTrace(char const *fileName) {
+	std::ofstream out(fileName);
+	if (!out) {
+		return false;
+	}
+	boost::unique_lock<boost::mutex> buffersLock(buffersMutex);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	for (unsigned i = 0; i < buffers.size(); ++i) {
+		TraceBuffer &buffer = buffers[i];
+		boost::unique_lock<boost::mutex> lock(buffer.mutex);
+		for (unsigned j = 0; j < buffer.events.size(); ++j) {
+			TraceEvent const &event = buffer.events[j];
+			out << (first ? "" : ",\n")
+				<< "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.threadId
+				<< ",\"ts\":" << (event.start - traceStart) / 1000 << '.' << (event.start - traceStart) % 1000 / 100
+				<< ",\"dur\":" << event.duration / 1000 << '.' << event.duration % 1000 / 100;
+			if (event.hasChunkIndex) {
+				out << ",\"args\":{\"chunk\":[" << event.chunkIndex.x << ',' << event.chunkIndex.y << ',' << event.chunkIndex.z << "]}";
+			}
+			out << '}';
+			first = false;
+		}
+	}
+	out << "\n]}\n";
+	return out.good();
+}
+
+TraceSpan::TraceSpan(char const *name)
+:
+	name(name),
+	hasChunkIndex(false),
+	start(tracing ? now() : 0)
+{
+}
+
+TraceSpan::TraceSpan(char const *name, int3 chunkIndex)
+:
+	name(name),
+	hasChunkIndex(true),
+	chunkIndex(chunkIndex),
+	start(tracing ? now() : 0)
+{
+}
+
+TraceSpan::~TraceSpan() {
+	// Also skip spans that were already running when tracing started.
+	if (!start) {
+		return;
+	}
+	TraceEvent event;
+	event.name = name;
+	event.hasChunkIndex = hasChunkIndex;
+	event.chunkIndex = chunkIndex;
+	event.start = start;
+	event.duration = now() - start;
+	TraceBuffer &buffer = getCurrentBuffer();
+	boost::unique_lock<boost::mutex> lock(buffer.mutex);
+	buffer.events.push_back(event);
+}
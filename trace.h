@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "maths.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <stdint.h>
+
+/* Opt-in recording of spans of time, written out in the Chrome trace event format,
+ * which chrome://tracing and ui.perfetto.dev can show as a timeline per thread.
+ *
+ * Each thread appends to its own buffer, so recording a span takes only an uncontended lock.
+ * When tracing is not enabled, a span does nothing at all.
+ */
+
+bool isTracing();
+void startTracing();
+bool writeTrace(char const *fileName);
+
+/* Records the time between its construction and destruction on the current thread.
+ * The name must be a string literal, or at least outlive the trace.
+ */
+class TraceSpan
+:
+	boost::noncopyable
+{
+
+	char const *name;
+	bool hasChunkIndex;
+	int3 chunkIndex;
+	uint64_t start;
+
+	public:
+
+		explicit TraceSpan(char const *name);
+		TraceSpan(char const *name, int3 chunkIndex);
+		~TraceSpan();
+
+};
+
+#endif